@@ -1,8 +1,36 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <ostream>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
 #include <utility>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 template <std::size_t N, typename... T> struct typelist_find_helper;
 template <std::size_t N, typename T> struct typelist_find_helper<N, T> {
@@ -54,6 +82,12 @@ template <template <typename> class R, typename Tlist> struct type_list_apply {
   using type = typename type_list_apply_helper<R, Tlist>::type;
 };
 
+template <typename Tlist, typename T> struct type_list_append;
+template <typename... Ts, typename T>
+struct type_list_append<typelist<Ts...>, T> {
+  using type = typelist<Ts..., T>;
+};
+
 template <typename Tlist> struct chain_derived_typelist_container;
 template <typename T, typename... R>
 struct chain_derived_typelist_container<typelist<T, R...>> {
@@ -80,36 +114,333 @@ using char_type = char;
 constexpr char_type char_type_minium = CHAR_MIN;
 constexpr char_type char_type_maxium = CHAR_MAX;
 
-template <typename V> struct node_base;
-template <typename V> struct node0;
-template <typename V> struct node4;
-template <typename V> struct node16;
-template <typename V> struct node48;
-template <typename V> struct node256;
+// The bytes the tree orders a key by. A string key is its own bytes, and the
+// subfix of a data node points to the tail of its key.
+template <typename K, typename = void> struct art_key_traits {
+  using view_type = std::basic_string_view<char_type>;
+  // encode() returns bytes that outlive the call
+  constexpr static bool bytes_in_key = true;
+
+  static view_type encode(view_type key) { return key; }
+  static K decode(const char_type *bytes, std::size_t size) {
+    return K(bytes, size);
+  }
+};
+
+// Integers are encoded big-endian in a register, with the sign bit flipped
+// for signed types and every byte biased to the char_type order, so byte
+// order is numeric order. All keys have sizeof(K) bytes: no key is a prefix
+// of another, and a lookup goes at most sizeof(K) levels down. A subfix
+// is always copied into subfix_inline_, which is made as wide as K, since
+// the encoded bytes are not in the key.
+template <typename K>
+struct art_key_traits<
+    K, typename std::enable_if<std::is_integral<K>::value &&
+                               !std::is_same<K, bool>::value>::type> {
+  using view_type = K;
+  struct encoded_type {
+    const char_type *data() const { return bytes_; }
+    constexpr static std::size_t size() { return sizeof(K); }
+
+    char_type bytes_[sizeof(K)];
+  };
+  constexpr static bool bytes_in_key = false;
+
+  static encoded_type encode(K key) {
+    const U u = byte_swap(flip(static_cast<U>(key)));
+    encoded_type e;
+    std::memcpy(e.bytes_, &u, sizeof(K));
+    return e;
+  }
+  static K decode(const char_type *bytes) {
+    U u;
+    std::memcpy(&u, bytes, sizeof(K));
+    return static_cast<K>(flip(byte_swap(u)));
+  }
+  static K decode(const char_type *bytes, std::size_t) {
+    return decode(bytes);
+  }
+
+  using U = typename std::make_unsigned<K>::type;
+  static U flip(U u) {
+    if (std::is_signed<K>::value) {
+      u = static_cast<U>(u ^ (U(1) << (sizeof(K) * CHAR_BIT - 1)));
+    }
+    if (char_type_minium < 0) {
+      u = static_cast<U>(u ^ static_cast<U>(0x8080808080808080ull));
+    }
+    return u;
+  }
+  // to big-endian and back
+  static U byte_swap(U u) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (sizeof(K) == 8) {
+      return static_cast<U>(__builtin_bswap64(u));
+    } else if (sizeof(K) == 4) {
+      return static_cast<U>(__builtin_bswap32(static_cast<uint32_t>(u)));
+    } else if (sizeof(K) == 2) {
+      return static_cast<U>(__builtin_bswap16(static_cast<uint16_t>(u)));
+    }
+#endif
+    return u;
+  }
+};
+
+// Bytes of an encoded lookup key, on the stack unless they are long.
+struct art_key_buffer {
+  art_key_buffer() : size_(0) {}
+
+  const char_type *data() const {
+    return size_ <= inline_capacity ? inline_ : heap_.data();
+  }
+  std::size_t size() const { return size_; }
+
+  void append(const char_type *s, std::size_t n) {
+    if (size_ + n <= inline_capacity) {
+      std::memcpy(inline_ + size_, s, n);
+    } else {
+      if (size_ <= inline_capacity) {
+        heap_.assign(inline_, size_);
+      }
+      heap_.append(s, n);
+    }
+    size_ += n;
+  }
+  void push_back(char_type c) { append(&c, 1); }
+
+  constexpr static std::size_t inline_capacity = 64;
+
+  std::size_t size_;
+  char_type inline_[inline_capacity];
+  std::basic_string<char_type> heap_;
+};
+
+// Order-preserving encoding of one field of a composite key. Integers and
+// floats take a fixed number of bytes. A string is escaped, 0 as {0, 0xff},
+// and ends with {0, 0}, so a shorter string sorts first whatever follows it;
+// the last field of a key is neither escaped nor ended. Bytes are in the
+// unsigned order here and biased to char_type order like integer keys.
+template <typename T, typename = void> struct art_field_codec;
+
+template <typename T>
+struct art_field_codec<
+    T, typename std::enable_if<std::is_integral<T>::value &&
+                               !std::is_same<T, bool>::value>::type> {
+  template <typename Out> static void encode(Out &out, T v, bool) {
+    const auto e = art_key_traits<T>::encode(v);
+    out.append(e.data(), e.size());
+  }
+  static void decode(const char_type *&p, const char_type *end, T &v, bool) {
+    if (end - p < static_cast<std::ptrdiff_t>(sizeof(T))) {
+      throw "bad key field";
+    }
+    v = art_key_traits<T>::decode(p);
+    p += sizeof(T);
+  }
+};
+
+// the bits of a negative float are inverted and the sign bit of a positive
+// one is set, which orders them like integers: -inf < -0.0 < 0.0 < inf
+template <typename T>
+struct art_field_codec<
+    T, typename std::enable_if<std::is_same<T, float>::value ||
+                               std::is_same<T, double>::value>::type> {
+  using U = typename std::conditional<sizeof(T) == 4, uint32_t, uint64_t>::type;
+  constexpr static U sign_bit = U(1) << (sizeof(U) * CHAR_BIT - 1);
+
+  template <typename Out> static void encode(Out &out, T v, bool last) {
+    U u;
+    std::memcpy(&u, &v, sizeof(U));
+    u = (u & sign_bit) ? ~u : u | sign_bit;
+    art_field_codec<U>::encode(out, u, last);
+  }
+  static void decode(const char_type *&p, const char_type *end, T &v,
+                     bool last) {
+    U u;
+    art_field_codec<U>::decode(p, end, u, last);
+    u = (u & sign_bit) ? u & ~sign_bit : ~u;
+    std::memcpy(&v, &u, sizeof(U));
+  }
+};
+
+template <> struct art_field_codec<std::basic_string<char_type>> {
+  constexpr static char_type bias = char_type_minium < 0 ? CHAR_MIN : 0;
+
+  template <typename Out>
+  static void encode(Out &out, std::basic_string_view<char_type> v,
+                     bool last) {
+    for (const char_type c : v) {
+      out.push_back(c ^ bias);
+      if (c == 0 && !last) {
+        out.push_back(static_cast<char_type>(0xff) ^ bias);
+      }
+    }
+    if (!last) {
+      out.push_back(bias);
+      out.push_back(bias);
+    }
+  }
+  static void decode(const char_type *&p, const char_type *end,
+                     std::basic_string<char_type> &v, bool last) {
+    v.clear();
+    while (p != end) {
+      const char_type c = *p++ ^ bias;
+      if (c == 0 && !last) {
+        if (p == end) {
+          throw "bad key field";
+        }
+        if ((*p++ ^ bias) == 0) {
+          return;
+        }
+      }
+      v.push_back(c);
+    }
+    if (!last) {
+      throw "bad key field";
+    }
+  }
+};
+
+// A composite key kept as its encoded bytes. It sorts in the tree like the
+// tuple of its fields, and its data node points into it like a string key.
+// Lookups take the tuple and encode it into an art_key_buffer.
+template <typename... Ts> struct art_tuple_key {
+  using tuple_type = std::tuple<Ts...>;
+
+  art_tuple_key() = default;
+  art_tuple_key(const tuple_type &fields) { encode(bytes_, fields); }
+  art_tuple_key(const Ts &...fields) {
+    encode(bytes_, std::forward_as_tuple(fields...));
+  }
+
+  const char_type *data() const { return bytes_.data(); }
+  const char_type *c_str() const { return bytes_.c_str(); }
+  std::size_t size() const { return bytes_.size(); }
+
+  tuple_type decode() const {
+    tuple_type fields;
+    decode_fields(fields, std::index_sequence_for<Ts...>());
+    return fields;
+  }
+
+  bool operator==(const art_tuple_key &other) const {
+    return bytes_ == other.bytes_;
+  }
+  bool operator!=(const art_tuple_key &other) const {
+    return bytes_ != other.bytes_;
+  }
+
+  template <typename Out, typename Tuple>
+  static void encode(Out &out, const Tuple &fields) {
+    encode_fields(out, fields, std::index_sequence_for<Ts...>());
+  }
+  template <typename Out, typename Tuple, std::size_t... I>
+  static void encode_fields(Out &out, const Tuple &fields,
+                            std::index_sequence<I...>) {
+    (void)std::initializer_list<int>{
+        (art_field_codec<Ts>::encode(out, std::get<I>(fields),
+                                     I + 1 == sizeof...(Ts)),
+         0)...};
+  }
+  template <std::size_t... I>
+  void decode_fields(tuple_type &fields, std::index_sequence<I...>) const {
+    const char_type *p = data();
+    const char_type *end = p + size();
+    (void)std::initializer_list<int>{
+        (art_field_codec<Ts>::decode(p, end, std::get<I>(fields),
+                                     I + 1 == sizeof...(Ts)),
+         0)...};
+  }
+
+  std::basic_string<char_type> bytes_;
+};
+
+template <typename... Ts> struct art_key_traits<art_tuple_key<Ts...>> {
+  using view_type = const std::tuple<Ts...> &;
+  constexpr static bool bytes_in_key = true;
+
+  static std::basic_string_view<char_type>
+  encode(const art_tuple_key<Ts...> &key) {
+    return {key.data(), key.size()};
+  }
+  static art_key_buffer encode(view_type fields) {
+    art_key_buffer buffer;
+    art_tuple_key<Ts...>::encode(buffer, fields);
+    return buffer;
+  }
+  static art_tuple_key<Ts...> decode(const char_type *bytes,
+                                     std::size_t size) {
+    art_tuple_key<Ts...> key;
+    key.bytes_.assign(bytes, size);
+    return key;
+  }
+};
 
-template <typename V> using node_type_guard = node0<V>;
+// Compile-time options of a tree and its nodes. With SubtreeCounts every
+// node keeps the number of elements under it, for rank() and select().
+// Without Linked the data nodes are not kept in a list: nodes are smaller and
+// inserts skip the descents that find their neighbours, while iterators step
+// through the tree instead. With Snapshots every node keeps the generation it
+// was made in, for art::snapshot().
+template <bool SubtreeCounts = false, bool Linked = true,
+          bool Snapshots = false>
+struct art_options {
+  constexpr static bool subtree_counts = SubtreeCounts;
+  constexpr static bool linked = Linked;
+  constexpr static bool snapshots = Snapshots;
+};
 
-template <typename V>
-using levellist =
-    typelist<node4<V>, node16<V>, node48<V>, node256<V>, node_type_guard<V>>;
+template <typename V, typename P = art_options<>> struct node_base;
+template <typename V, typename P = art_options<>> struct node0;
+template <typename V, typename P = art_options<>> struct node4;
+template <typename V, typename P = art_options<>> struct node16;
+template <typename V, typename P = art_options<>> struct node48;
+template <typename V, typename P = art_options<>> struct node256;
+template <typename V, typename P = art_options<>> struct node_guard;
+template <typename V, typename P> struct node_inner;
+
+template <typename V, typename P> using node_type_guard = node_guard<V, P>;
+
+template <typename V, typename P, typename F>
+decltype(auto) node_visit(node_base<V, P> *node, F &&f);
+template <typename V, typename P, typename F>
+decltype(auto) node_visit(const node_base<V, P> *node, F &&f);
+
+template <typename V, typename P = art_options<>>
+using levellist = typelist<node0<V, P>, node4<V, P>, node16<V, P>,
+                           node48<V, P>, node256<V, P>, node_type_guard<V, P>>;
+
+template <typename K, typename V, typename Alloc,
+          typename Options = art_options<>>
+struct art_tree;
+
+// the tree an iterator steps back from end() in, only kept without links
+template <typename Tree, bool linked> struct art_iterator_tree {
+  const Tree *tree() const { return nullptr; }
+  void set_tree(const Tree *) {}
+};
+template <typename Tree> struct art_iterator_tree<Tree, false> {
+  const Tree *tree() const { return tree_; }
+  void set_tree(const Tree *tree) { tree_ = tree; }
 
-template <typename K, typename V, typename Alloc> struct art_tree;
+  const Tree *tree_;
+};
 
-template <typename V> struct child_slot {
+template <typename V, typename P = art_options<>> struct child_slot {
   char_type c;
-  node_base<V> **node;
+  node_base<V, P> **node;
 };
 
-template <typename V> struct const_child_slot {
+template <typename V, typename P = art_options<>> struct const_child_slot {
   char_type c;
-  node_base<V> *const *node;
+  node_base<V, P> *const *node;
 };
 
 enum bound_direction { lower, upper };
 
-template <typename V> struct find_result_type {
-  node_base<V> *node;        // current node
-  child_slot<V> parent_slot; // parent child slot
+template <typename V, typename P = art_options<>> struct find_result_type {
+  node_base<V, P> *node;        // current node
+  child_slot<V, P> parent_slot; // parent child slot
   size_t key_cur;      // diff cursor of key, equal to key size when key match.
   size_t node_sub_cur; // diff cursor of node subfix
 };
@@ -118,127 +449,264 @@ struct node_link_base {
   node_link_base *prev_;
   node_link_base *next_;
 };
+// base of nodes in place of node_link_base, without links
+struct node_unlinked_base {};
+
+// number of elements in the subtree of a node, kept with art_options<true>
+template <bool counted> struct node_subtree_count {
+  std::size_t subtree_count() const { return 0; }
+  void set_subtree_count(std::size_t) {}
+};
+template <> struct node_subtree_count<true> {
+  std::size_t subtree_count() const { return subtree_count_; }
+  void set_subtree_count(std::size_t n) { subtree_count_ = n; }
 
-template <typename V> struct node_base : public node_link_base {
+  std::size_t subtree_count_;
+};
+
+// tree generation the node was made in, kept with snapshots
+template <bool stamped> struct node_generation {
+  uint32_t generation() const { return 0; }
+  void set_generation(uint32_t) {}
+};
+template <> struct node_generation<true> {
+  uint32_t generation() const { return generation_; }
+  void set_generation(uint32_t g) { generation_ = g; }
+
+  uint32_t generation_;
+};
+
+template <typename V, typename P>
+struct node_base
+    : public std::conditional<P::linked, node_link_base,
+                              node_unlinked_base>::type,
+      public node_subtree_count<P::subtree_counts>,
+      public node_generation<P::snapshots> {
   using key_type =
       typename std::remove_const<typename std::tuple_element<0, V>::type>::type;
   using mapped_type = typename std::tuple_element<1, V>::type;
   using value_type = V;
+  using key_traits = art_key_traits<key_type>;
 
-  node_base() = default;
-  virtual ~node_base() = default;
-
-  virtual std::size_t node_size() const = 0;
-  virtual node_base<value_type> *expand_new(void *art_tree_ptr) = 0;
-  virtual void dealloc(void *art_tree_ptr) = 0;
+  // index of the node type in levellist
+  template <typename node_type> constexpr static uint8_t type_of() {
+    return levellist<value_type, P>::template find<node_type>();
+  }
 
-  virtual const_child_slot<value_type> find_child_impl(char_type c) const = 0;
-  virtual child_slot<value_type> find_leq_child(char_type c) = 0;
-  virtual child_slot<value_type> find_geq_child(char_type c) = 0;
-  virtual int get_all_children_impl(child_slot<value_type> slots[256]) = 0;
-  virtual std::pair<child_slot<value_type>, bool>
-  try_insert_child_impl(char_type c, node_base *node) = 0;
-  virtual void erase_child(char_type c) = 0;
+  // dispatch on type_ to the concrete node type, see node_visit()
+  std::size_t node_size() const;
+  const_child_slot<value_type, P> find_child_impl(char_type c) const;
+  child_slot<value_type, P> find_leq_child(char_type c);
+  child_slot<value_type, P> find_geq_child(char_type c);
+  int get_all_children_impl(child_slot<value_type, P> slots[256]);
+  std::pair<child_slot<value_type, P>, bool>
+  try_insert_child_impl(char_type c, node_base *node);
+  void erase_child(char_type c);
 
   bool children_empty() const { return children_size_ == 0; }
 
-  int get_all_children(child_slot<value_type> slots[256]) {
+  int get_all_children(child_slot<value_type, P> slots[256]) {
     if (children_empty()) {
       return 0;
     }
     return get_all_children_impl(slots);
   }
-  const_child_slot<value_type> find_child(char_type c) const {
-    const_child_slot<value_type> cslot;
+  const_child_slot<value_type, P> find_child(char_type c) const {
+    const_child_slot<value_type, P> cslot{};
     if (children_empty()) {
       cslot.node = nullptr;
       return cslot;
     }
     return find_child_impl(c);
   }
-  child_slot<value_type> find_child(char_type c) {
-    const_child_slot<value_type> cslot =
+  child_slot<value_type, P> find_child(char_type c) {
+    const_child_slot<value_type, P> cslot =
         const_cast<const node_base *>(this)->find_child(c);
-    child_slot<value_type> slot;
+    child_slot<value_type, P> slot{};
     slot.c = cslot.c;
     slot.node = const_cast<node_base **>(cslot.node);
     return slot;
   }
-  child_slot<value_type> find_less_child(char_type c) {
-    child_slot<value_type> slot;
+  child_slot<value_type, P> find_less_child(char_type c) {
+    child_slot<value_type, P> slot{};
     if (c == char_type_minium) {
       slot.node = nullptr;
       return slot;
     }
     return find_leq_child(c - 1);
   }
-  child_slot<value_type> find_greater_child(char_type c) {
-    child_slot<value_type> slot;
+  child_slot<value_type, P> find_greater_child(char_type c) {
+    child_slot<value_type, P> slot{};
     if (c == char_type_maxium) {
       slot.node = nullptr;
       return slot;
     }
     return find_geq_child(c + 1);
   }
-  child_slot<value_type> find_min_child() {
+  child_slot<value_type, P> find_min_child() {
     return find_geq_child(char_type_minium);
   }
-  child_slot<value_type> find_max_child() {
+  child_slot<value_type, P> find_max_child() {
     return find_leq_child(char_type_maxium);
   }
 
-  void set_node_value(const value_type &value) {
-    value_storage_.first = value.first;
-    new (&value_storage_.second) mapped_type(value.second);
-    storage_valid_ = true;
+  // A node0 holds its value, the others point to a value the tree
+  // allocated for them, see node_inner.
+  bool value_boxed() const { return type_ != type_of<node0<V, P>>(); }
+  value_type *value_slot() {
+    if (!value_boxed()) {
+      return reinterpret_cast<value_type *>(
+          &static_cast<node0<V, P> *>(this)->value_storage_);
+    }
+    return static_cast<node_inner<V, P> *>(this)->value_;
   }
-  void move_node_value(value_type &&value) {
-    value_storage_.first = std::forward<const key_type>(value.first);
-    new (&value_storage_.second)
-        mapped_type(std::forward<mapped_type>(value.second));
+  const value_type *value_slot() const {
+    return const_cast<node_base *>(this)->value_slot();
+  }
+
+  // the tree gives an inner node its box first, see node_emplace_value()
+  template <typename... Args> void emplace_node_value(Args &&...args) {
+    new (value_slot()) value_type(std::forward<Args>(args)...);
     storage_valid_ = true;
+    if constexpr (key_traits::bytes_in_key) {
+      // a long subfix is the tail of the key from now on
+      if (subfix_size_ > subfix_inline_capacity) {
+        const auto key = key_traits::encode(get_value().first);
+        subfix_start_ =
+            const_cast<char_type *>(key.data() + key.size() - subfix_size_);
+      }
+    }
   }
+  // the node keeps the head of its subfix, the rest is in the keys below.
   void unset_node_value() {
-    get_value().second.~mapped_type();
+    char_type head[subfix_inline_capacity];
+    const std::size_t head_size =
+        std::min<std::size_t>(subfix_size_, subfix_inline_capacity);
+    std::memcpy(head, subfix_head(), head_size);
+    get_value().~value_type();
     storage_valid_ = false;
+    std::memcpy(subfix_inline_, head, head_size);
+  }
+  // destroy the value, before the node is freed.
+  void clear_node_storage() {
+    if (storage_valid_) {
+      get_value().~value_type();
+      storage_valid_ = false;
+    }
   }
   value_type &get_value() {
     if (!storage_valid_) {
       throw "get value";
     }
-    return *reinterpret_cast<value_type *>(&value_storage_);
+    return *value_slot();
   }
   const value_type &get_value() const {
     if (!storage_valid_) {
       throw "get value";
     }
-    return *reinterpret_cast<const value_type *>(&value_storage_);
+    return *value_slot();
   }
 
-  // if node's storage will be valid, set value before calling this function.
+  // The subfix is kept in subfix_inline_ when it fits. Otherwise a data node
+  // points to the tail of its key, and an inner node keeps the head of the
+  // subfix and finds all of it in the key of the first data node below, at
+  // the same depth.
+  const char_type *subfix() const {
+    return subfix_in_leaf() ? leaf_subfix() : subfix_head();
+  }
+  // the first min(subfix_size_, subfix_inline_capacity) bytes, or all of
+  // them unless subfix_in_leaf()
+  const char_type *subfix_head() const {
+    return storage_valid_ && subfix_size_ > subfix_inline_capacity
+               ? subfix_start_
+               : subfix_inline_;
+  }
+  bool subfix_in_leaf() const {
+    return !storage_valid_ && subfix_size_ > subfix_inline_capacity;
+  }
+  const char_type *leaf_subfix() const {
+    if constexpr (key_traits::bytes_in_key) {
+      std::size_t rest = subfix_size_;
+      const node_base *node = this;
+      while (!node->storage_valid_) {
+        node = *const_cast<node_base *>(node)->find_min_child().node;
+        rest += 1 + node->subfix_size_;
+      }
+      const auto key = key_traits::encode(node->get_value().first);
+      return key.data() + key.size() - rest;
+    } else {
+      return subfix_inline_;
+    }
+  }
+
+  // If node's storage will be valid, set value before calling this function,
+  // the subfix of data node is always the tail of its key. An inner node
+  // only reads the head of subfix, which may point into the node.
   void set_node_subfix(const char_type *subfix, std::size_t subfix_size) {
-    if (!storage_valid_) {
-      // the key of storage is just subfix, not full key
-      value_storage_.first = key_type(subfix, subfix_size);
+    if (storage_valid_) {
+      const auto key = key_traits::encode(get_value().first);
+      subfix = key.data() + key.size() - subfix_size;
+      if (subfix_size <= subfix_inline_capacity) {
+        std::memcpy(subfix_inline_, subfix, subfix_size);
+      } else if constexpr (key_traits::bytes_in_key) {
+        subfix_start_ = const_cast<char_type *>(subfix);
+      }
+      subfix_size_ = subfix_size;
+      return;
+    }
+
+    if (subfix_size != 0) {
+      std::memmove(subfix_inline_, subfix,
+                   std::min<std::size_t>(subfix_size, subfix_inline_capacity));
     }
-    subfix_start_ = const_cast<char_type *>(value_storage_.first.c_str()) +
-                    value_storage_.first.size() - subfix_size;
     subfix_size_ = subfix_size;
   }
   void truncate_node_prefix(std::size_t truncate_size) {
-    subfix_size_ -= truncate_size;
-    subfix_start_ += truncate_size;
+    set_node_subfix(subfix() + truncate_size, subfix_size_ - truncate_size);
+  }
+  // the subfix becomes that of parent, c and its own, when this node takes
+  // the place of parent, only the heads are read
+  void prepend_node_subfix(const node_base *parent, char_type c) {
+    char_type head[subfix_inline_capacity];
+    std::size_t n =
+        std::min<std::size_t>(parent->subfix_size_, subfix_inline_capacity);
+    std::memcpy(head, parent->subfix_head(), n);
+    if (n < subfix_inline_capacity) {
+      head[n++] = c;
+    }
+    std::memcpy(head + n, subfix_head(),
+                std::min<std::size_t>(subfix_size_,
+                                      subfix_inline_capacity - n));
+    set_node_subfix(head, parent->subfix_size_ + 1 + subfix_size_);
   }
+  // The head is compared first, a long inner subfix goes down to a data
+  // node only if the head matches.
   std::pair<std::size_t, int> compare(const char_type *s,
                                       std::size_t ssize) const {
-    const std::size_t ds = std::min(subfix_size_, ssize);
+    if (!subfix_in_leaf()) {
+      return compare_subfix(subfix_head(), subfix_size_, s, ssize);
+    }
+    auto r = compare_subfix(subfix_inline_, subfix_inline_capacity, s, ssize);
+    if (r.first < subfix_inline_capacity) {
+      if (r.first == ssize) {
+        r.second = static_cast<int>(subfix_size_ - ssize);
+      }
+      return r;
+    }
+    return compare_subfix(leaf_subfix(), subfix_size_, s, ssize);
+  }
+  static std::pair<std::size_t, int> compare_subfix(const char_type *sub,
+                                                    std::size_t sub_size,
+                                                    const char_type *s,
+                                                    std::size_t ssize) {
+    const std::size_t ds = std::min(sub_size, ssize);
     std::size_t i = 0;
 
     // loop unfold
 #define DO(n)                                                                  \
   do {                                                                         \
     const std::size_t p = i + n;                                               \
-    const char_type d = subfix_start_[p] - s[p];                               \
+    const char_type d = sub[p] - s[p];                                         \
     if (d != 0) {                                                              \
       return {p, static_cast<int>(d)};                                         \
     }                                                                          \
@@ -264,13 +732,13 @@ template <typename V> struct node_base : public node_link_base {
 
 #undef DO
 
-    return {ds, subfix_size_ - ssize};
+    return {ds, sub_size - ssize};
   }
 
   node_base *find_min_data_node() {
     node_base *node = this;
     while (!node->storage_valid_) {
-      child_slot<value_type> slot = node->find_min_child();
+      child_slot<value_type, P> slot = node->find_min_child();
       node = *slot.node;
     }
 
@@ -283,7 +751,7 @@ template <typename V> struct node_base : public node_link_base {
   node_base *find_max_data_node() {
     node_base *node = this;
     while (true) {
-      child_slot<value_type> slot = node->find_max_child();
+      child_slot<value_type, P> slot = node->find_max_child();
       if (slot.node == nullptr) {
         break;
       }
@@ -296,9 +764,40 @@ template <typename V> struct node_base : public node_link_base {
 
     return node;
   }
+  // the data nodes before and after this one in key order, nullptr past the
+  // ends. They walk up parent_ to the first branch on that side, for trees
+  // that keep no links.
+  node_base *next_data_node() {
+    if (!children_empty()) {
+      return (*find_min_child().node)->find_min_data_node();
+    }
+    for (node_base *node = this; node->parent_ != nullptr;
+         node = node->parent_) {
+      child_slot<value_type, P> slot =
+          node->parent_->find_greater_child(node->parent_c_);
+      if (slot.node != nullptr) {
+        return (*slot.node)->find_min_data_node();
+      }
+    }
+    return nullptr;
+  }
+  node_base *prev_data_node() {
+    for (node_base *node = this; node->parent_ != nullptr;
+         node = node->parent_) {
+      child_slot<value_type, P> slot =
+          node->parent_->find_less_child(node->parent_c_);
+      if (slot.node != nullptr) {
+        return (*slot.node)->find_max_data_node();
+      }
+      if (node->parent_->storage_valid_) {
+        return node->parent_;
+      }
+    }
+    return nullptr;
+  }
 
-  std::pair<child_slot<value_type>, bool> try_insert_child(char_type c,
-                                                           node_base *node) {
+  std::pair<child_slot<value_type, P>, bool> try_insert_child(char_type c,
+                                                              node_base *node) {
     auto r = try_insert_child_impl(c, node);
     if (r.second) {
       node->parent_ = this;
@@ -307,226 +806,964 @@ template <typename V> struct node_base : public node_link_base {
     return r;
   }
 
-  std::pair<key_type,
-            typename std::aligned_storage<sizeof(mapped_type), 8>::type>
-      value_storage_;
+  // Keys that are not kept as bytes fit here whole, so only string and tuple
+  // keys have subfixes that do not.
+  constexpr static std::size_t subfix_inline_capacity =
+      key_traits::bytes_in_key
+          ? sizeof(char_type *)
+          : std::max(sizeof(char_type *), sizeof(key_type));
+
   node_base *parent_;
-  std::size_t subfix_size_;
-  char_type *subfix_start_;
+  uint32_t subfix_size_;
+  // optimistic lock of concurrent_art, unused by art
+  std::atomic<uint32_t> version_;
+  union {
+    char_type *subfix_start_;
+    char_type subfix_inline_[subfix_inline_capacity];
+  };
   uint16_t children_size_;
+  uint8_t type_;
   bool storage_valid_;
   char_type parent_c_;
 };
 
-template <typename V> struct node0 : public node_base<V> {
-  std::size_t node_size() const override { throw "not implement"; }
-  const_child_slot<V> find_child_impl(char_type c) const override {
+// Base of the nodes that may have children. Most of them hold no value, so
+// the value of one that does is allocated by the tree apart from the node.
+template <typename V, typename P> struct node_inner : public node_base<V, P> {
+  V *value_;
+};
+
+// leaf node, only holds the value. It is expanded to node4 when the first
+// child is inserted.
+template <typename V, typename P> struct node0 : public node_base<V, P> {
+  std::size_t node_size() const;
+  const_child_slot<V, P> find_child_impl(char_type c) const;
+  child_slot<V, P> find_leq_child(char_type c);
+  child_slot<V, P> find_geq_child(char_type c);
+  int get_all_children_impl(child_slot<V, P> slots[256]);
+  std::pair<child_slot<V, P>, bool>
+  try_insert_child_impl(char_type c, node_base<V, P> *node);
+  void erase_child(char_type c);
+
+  constexpr static int max_children_size = 0;
+  // shrink to the previous node type at this size, below its max for
+  // hysteresis
+  constexpr static int shrink_children_size = -1;
+
+  typename std::aligned_storage<sizeof(V), alignof(V)>::type value_storage_;
+};
+
+template <typename V, typename P> struct node_guard : public node_inner<V, P> {
+  std::size_t node_size() const { throw "not implement"; }
+  const_child_slot<V, P> find_child_impl(char_type c) const {
     throw "not implement";
   }
-  child_slot<V> find_leq_child(char_type c) override { throw "not implement"; }
-  child_slot<V> find_geq_child(char_type c) override { throw "not implement"; }
-  int get_all_children_impl(child_slot<V> slots[256]) override {
+  child_slot<V, P> find_leq_child(char_type c) { throw "not implement"; }
+  child_slot<V, P> find_geq_child(char_type c) { throw "not implement"; }
+  int get_all_children_impl(child_slot<V, P> slots[256]) {
     throw "not implement";
   }
-  std::pair<child_slot<V>, bool>
-  try_insert_child_impl(char_type c, node_base<V> *node) override {
+  std::pair<child_slot<V, P>, bool>
+  try_insert_child_impl(char_type c, node_base<V, P> *node) {
     throw "not implement";
   }
-  void erase_child(char_type c) override { throw "not implement"; }
+  void erase_child(char_type c) { throw "not implement"; }
 };
 
-template <typename V> struct node4 : public node_base<V> {
-  std::size_t node_size() const override;
-  const_child_slot<V> find_child_impl(char_type c) const override;
-  child_slot<V> find_leq_child(char_type c) override;
-  child_slot<V> find_geq_child(char_type c) override;
-  int get_all_children_impl(child_slot<V> slots[256]) override;
-  std::pair<child_slot<V>, bool>
-  try_insert_child_impl(char_type c, node_base<V> *node) override;
-  void erase_child(char_type c) override;
+template <typename V, typename P> struct node4 : public node_inner<V, P> {
+  std::size_t node_size() const;
+  const_child_slot<V, P> find_child_impl(char_type c) const;
+  child_slot<V, P> find_leq_child(char_type c);
+  child_slot<V, P> find_geq_child(char_type c);
+  int get_all_children_impl(child_slot<V, P> slots[256]);
+  std::pair<child_slot<V, P>, bool>
+  try_insert_child_impl(char_type c, node_base<V, P> *node);
+  void erase_child(char_type c);
+
+  // keys_ is kept sorted, each mask has one bit (0x80) per valid key byte.
+  uint32_t keys_word() const;
+  uint32_t valid_mask() const;
+  uint32_t eq_mask(char_type c) const;
+  uint32_t lt_mask(char_type c) const;
+  uint32_t gt_mask(char_type c) const;
+  constexpr static uint32_t sign_bias =
+      std::is_signed<char_type>::value ? 0x80808080u : 0;
 
   char_type keys_[4];
-  node_base<V> *children_[4];
+  node_base<V, P> *children_[4];
 
   constexpr static int max_children_size = 4;
+  // shrink to the previous node type at this size, below its max for
+  // hysteresis
+  constexpr static int shrink_children_size = 0;
 };
 
-template <typename V> struct node16 : public node_base<V> {
-  std::size_t node_size() const override;
-  const_child_slot<V> find_child_impl(char_type c) const override;
-  child_slot<V> find_leq_child(char_type c) override;
-  child_slot<V> find_geq_child(char_type c) override;
-  int get_all_children_impl(child_slot<V> slots[256]) override;
-  std::pair<child_slot<V>, bool>
-  try_insert_child_impl(char_type c, node_base<V> *node) override;
-  void erase_child(char_type c) override;
+template <typename V, typename P> struct node16 : public node_inner<V, P> {
+  std::size_t node_size() const;
+  const_child_slot<V, P> find_child_impl(char_type c) const;
+  child_slot<V, P> find_leq_child(char_type c);
+  child_slot<V, P> find_geq_child(char_type c);
+  int get_all_children_impl(child_slot<V, P> slots[256]);
+  std::pair<child_slot<V, P>, bool>
+  try_insert_child_impl(char_type c, node_base<V, P> *node);
+  void erase_child(char_type c);
+
+  // keys_ is kept sorted, each mask has one bit per valid key.
+  unsigned valid_mask() const;
+  unsigned eq_mask(char_type c) const;
+  unsigned lt_mask(char_type c) const;
+  unsigned gt_mask(char_type c) const;
+  // xor that makes the signed SSE compares order bytes as char_type
+  constexpr static char sign_bias =
+      std::is_signed<char_type>::value ? 0 : static_cast<char>(0x80);
 
   char_type keys_[16];
-  node_base<V> *children_[16];
+  node_base<V, P> *children_[16];
 
   constexpr static int max_children_size = 16;
+  // shrink to the previous node type at this size, below its max for
+  // hysteresis
+  constexpr static int shrink_children_size = 3;
+};
+
+// One bit per child byte of node48 and node256, at c - char_type_minium, so
+// the nearest child on either side of a byte is found with a bit scan over at
+// most four words instead of a slot by slot loop.
+struct node_child_bitmap {
+  static unsigned bit(char_type c) {
+    return static_cast<unsigned>(c - char_type_minium);
+  }
+  static char_type byte(unsigned w, unsigned b) {
+    return static_cast<char_type>(w * 64 + b + char_type_minium);
+  }
+
+  void set(char_type c) {
+    words_[bit(c) / 64] |= uint64_t(1) << (bit(c) % 64);
+  }
+  void reset(char_type c) {
+    words_[bit(c) / 64] &= ~(uint64_t(1) << (bit(c) % 64));
+  }
+  // the greatest child byte <= c, false if there is none
+  bool find_leq(char_type c, char_type *found) const {
+    unsigned w = bit(c) / 64;
+    uint64_t word = words_[w] & (~uint64_t(0) >> (63 - bit(c) % 64));
+    while (word == 0) {
+      if (w == 0) {
+        return false;
+      }
+      word = words_[--w];
+    }
+    *found = byte(w, 63 - __builtin_clzll(word));
+    return true;
+  }
+  // the least child byte >= c, false if there is none
+  bool find_geq(char_type c, char_type *found) const {
+    unsigned w = bit(c) / 64;
+    uint64_t word = words_[w] & (~uint64_t(0) << (bit(c) % 64));
+    while (word == 0) {
+      if (w == 3) {
+        return false;
+      }
+      word = words_[++w];
+    }
+    *found = byte(w, __builtin_ctzll(word));
+    return true;
+  }
+  // calls f on every child byte in order
+  template <typename F> void for_each(F &&f) const {
+    for (unsigned w = 0; w < 4; ++w) {
+      for (uint64_t word = words_[w]; word != 0; word &= word - 1) {
+        f(byte(w, __builtin_ctzll(word)));
+      }
+    }
+  }
+
+  uint64_t words_[4];
 };
 
-template <typename V> struct node48 : public node_base<V> {
-  uint8_t *children_index() { return children_index_ - char_type_minium; }
-  const uint8_t *children_index() const {
-    return children_index_ - char_type_minium;
+template <typename V, typename P> struct node48 : public node_inner<V, P> {
+  // children_index_ is in char_type order
+  uint8_t &child_index(char_type c) {
+    return children_index_[static_cast<uint8_t>(c - char_type_minium)];
+  }
+  uint8_t child_index(char_type c) const {
+    return children_index_[static_cast<uint8_t>(c - char_type_minium)];
   }
 
-  std::size_t node_size() const override;
-  const_child_slot<V> find_child_impl(char_type c) const override;
-  child_slot<V> find_leq_child(char_type c) override;
-  child_slot<V> find_geq_child(char_type c) override;
-  int get_all_children_impl(child_slot<V> slots[256]) override;
-  std::pair<child_slot<V>, bool>
-  try_insert_child_impl(char_type c, node_base<V> *node) override;
-  void erase_child(char_type c) override;
+  std::size_t node_size() const;
+  const_child_slot<V, P> find_child_impl(char_type c) const;
+  child_slot<V, P> find_leq_child(char_type c);
+  child_slot<V, P> find_geq_child(char_type c);
+  int get_all_children_impl(child_slot<V, P> slots[256]);
+  std::pair<child_slot<V, P>, bool>
+  try_insert_child_impl(char_type c, node_base<V, P> *node);
+  void erase_child(char_type c);
 
   uint8_t children_index_[256];
-  node_base<V> *children_[49]; // chilren_[0] always nullptr
+  // the byte of each slot, so erase finds what points at the moved slot
+  char_type children_key_[49];
+  node_base<V, P> *children_[49]; // chilren_[0] always nullptr
+  node_child_bitmap bitmap_;
 
   constexpr static int max_children_size = 48;
+  // shrink to the previous node type at this size, below its max for
+  // hysteresis
+  constexpr static int shrink_children_size = 12;
 };
 
-template <typename V> struct node256 : public node_base<V> {
-  node_base<V> **children() { return children_ - char_type_minium; }
-  node_base<V> *const *children() const { return children_ - char_type_minium; }
+template <typename V, typename P> struct node256 : public node_inner<V, P> {
+  // children_ is in char_type order
+  node_base<V, P> *&child(char_type c) {
+    return children_[static_cast<uint8_t>(c - char_type_minium)];
+  }
+  node_base<V, P> *const &child(char_type c) const {
+    return children_[static_cast<uint8_t>(c - char_type_minium)];
+  }
 
-  std::size_t node_size() const override;
-  const_child_slot<V> find_child_impl(char_type c) const override;
-  child_slot<V> find_leq_child(char_type c) override;
-  child_slot<V> find_geq_child(char_type c) override;
-  int get_all_children_impl(child_slot<V> slots[256]) override;
-  std::pair<child_slot<V>, bool>
-  try_insert_child_impl(char_type c, node_base<V> *node) override;
-  void erase_child(char_type c) override;
+  std::size_t node_size() const;
+  const_child_slot<V, P> find_child_impl(char_type c) const;
+  child_slot<V, P> find_leq_child(char_type c);
+  child_slot<V, P> find_geq_child(char_type c);
+  int get_all_children_impl(child_slot<V, P> slots[256]);
+  std::pair<child_slot<V, P>, bool>
+  try_insert_child_impl(char_type c, node_base<V, P> *node);
+  void erase_child(char_type c);
 
-  node_base<V> *children_[256];
+  node_base<V, P> *children_[256];
+  node_child_bitmap bitmap_;
 
   constexpr static int max_children_size = 256;
+  // shrink to the previous node type at this size, below its max for
+  // hysteresis
+  constexpr static int shrink_children_size = 36;
 };
 
-template <typename K, typename V, typename Alloc> struct art_tree {
-  using key_type = K;
-  using mapped_type = typename std::tuple_element<1, V>::type;
-  using value_type = std::pair<const key_type, mapped_type>;
-  using allocator_type = Alloc;
+// Over-aligned types take the aligned operator new.
+inline void *art_allocate_bytes(std::size_t size, std::size_t align) {
+  if (align > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+    return ::operator new(size, std::align_val_t(align));
+  }
+  return ::operator new(size);
+}
+inline void art_deallocate_bytes(void *p, std::size_t align) {
+  if (align > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+    ::operator delete(p, std::align_val_t(align));
+    return;
+  }
+  ::operator delete(p);
+}
+
+// Free list of equal slots carved from page-sized chunks. Each chunk starts
+// with a header that links the chunks, padded to the slot alignment.
+struct art_slab_pool {
+  struct chunk {
+    chunk *next;
+  };
 
-  template <typename node_type, typename = void>
-  struct node_alloca_helper : public node_type {
-    node_base<value_type> *expand_new(void *art_tree_ptr) override {
-      art_tree<key_type, value_type, Alloc> *art =
-          static_cast<art_tree<key_type, value_type, Alloc> *>(art_tree_ptr);
-      return art->template node_new<typename levellist<V>::template get_type<
-          levellist<V>::template find<node_type>() + 1>>();
+  constexpr static std::size_t page_size = 4096;
+
+  art_slab_pool(std::size_t size, std::size_t align)
+      : align_(std::max(align, alignof(void *))),
+        slot_size_((std::max(size, sizeof(void *)) + align_ - 1) / align_ *
+                   align_),
+        header_size_(std::max(align_, alignof(std::max_align_t))),
+        chunk_size_((std::max(page_size, header_size_ + 8 * slot_size_) +
+                     page_size - 1) /
+                    page_size * page_size),
+        free_list_(nullptr), chunks_(nullptr), cur_(nullptr), end_(nullptr) {
+  }
+  art_slab_pool(const art_slab_pool &) = delete;
+  ~art_slab_pool() { release(); }
+
+  void *allocate() {
+    if (free_list_ != nullptr) {
+      void *p = free_list_;
+      free_list_ = *static_cast<void **>(p);
+      return p;
+    }
+    if (cur_ + slot_size_ > end_) {
+      char *c =
+          static_cast<char *>(art_allocate_bytes(chunk_size_, header_size_));
+      reinterpret_cast<chunk *>(c)->next = chunks_;
+      chunks_ = reinterpret_cast<chunk *>(c);
+      cur_ = c + header_size_;
+      end_ = c + chunk_size_;
+    }
+    void *p = cur_;
+    cur_ += slot_size_;
+    return p;
+  }
+  void deallocate(void *p) {
+    *static_cast<void **>(p) = free_list_;
+    free_list_ = p;
+  }
+  void release() {
+    while (chunks_ != nullptr) {
+      chunk *next = chunks_->next;
+      art_deallocate_bytes(chunks_, header_size_);
+      chunks_ = next;
     }
+    free_list_ = nullptr;
+    cur_ = nullptr;
+    end_ = nullptr;
+  }
 
-    void dealloc(void *art_tree_ptr) override {
-      using node_alloca_type = typename std::allocator_traits<
-          Alloc>::template rebind_alloc<node_alloca_helper<node_type>>;
+  const std::size_t align_;
+  const std::size_t slot_size_;
+  const std::size_t header_size_;
+  const std::size_t chunk_size_;
+  void *free_list_;
+  chunk *chunks_;
+  char *cur_;
+  char *end_;
+};
 
-      art_tree<key_type, value_type, Alloc> *art =
-          static_cast<art_tree<key_type, value_type, Alloc> *>(art_tree_ptr);
-      node_alloca_helper::~node_alloca_helper();
-      art->impl_.node_alloca_type::deallocate(this, 1);
+// The pools of an art_slab_allocator, shared by all its copies and rebinds,
+// one per type and made on first use.
+struct art_slab_arena {
+  art_slab_pool &pool(const void *type, std::size_t size, std::size_t align) {
+    if (art_slab_pool *p = find(type)) {
+      return *p;
     }
-  };
+    pools_.emplace_back(type, std::make_unique<art_slab_pool>(size, align));
+    return *pools_.back().second;
+  }
+  art_slab_pool *find(const void *type) {
+    for (auto &p : pools_) {
+      if (p.first == type) {
+        return p.second.get();
+      }
+    }
+    return nullptr;
+  }
+
+  std::vector<std::pair<const void *, std::unique_ptr<art_slab_pool>>> pools_;
+};
 
-  template <typename unused>
-  struct node_alloca_helper<node_type_guard<value_type>, unused>
-      : public node_type_guard<value_type> {
-    node_base<value_type> *expand_new(void *art_tree_ptr) {
-      throw "not implement";
+// Slab allocator for tree nodes. Single objects are carved from page-sized
+// chunks and recycled through a free list, release() or destruction of the
+// last copy gives all chunks back at once. Copies and rebinds share one
+// arena and compare equal, and each type gets its own pool in it, so
+// art_tree ends up with one free list per node type in levellist.
+template <typename T> struct art_slab_allocator {
+  using value_type = T;
+
+  art_slab_allocator()
+      : arena_(std::make_shared<art_slab_arena>()), pool_(nullptr) {}
+  template <typename R>
+  art_slab_allocator(const art_slab_allocator<R> &other)
+      : arena_(other.arena_), pool_(nullptr) {}
+
+  T *allocate(std::size_t n) {
+    if (n != 1) {
+      return static_cast<T *>(art_allocate_bytes(n * sizeof(T), alignof(T)));
     }
-    void dealloc(void *art_tree_ptr) override { throw "not implement"; }
-  };
+    return static_cast<T *>(type_pool().allocate());
+  }
+  void deallocate(T *ptr, std::size_t n) {
+    if (n != 1) {
+      art_deallocate_bytes(ptr, alignof(T));
+      return;
+    }
+    type_pool().deallocate(ptr);
+  }
+  // free every chunk of the pool of T, all objects from it must be dead.
+  void release() {
+    if (art_slab_pool *p = arena_->find(type_key())) {
+      p->release();
+    }
+  }
+  // allocators sharing the arena, rebinds included
+  long use_count() const { return arena_.use_count(); }
 
-  template <typename node_type>
-  struct node_alloca_traits_rebind
-      : public std::allocator_traits<Alloc>::template rebind_alloc<
-            node_alloca_helper<node_type>> {
-    using traits = typename std::allocator_traits<Alloc>::template rebind_alloc<
-        node_alloca_helper<node_type>>;
-    using traits::traits;
+  template <typename R>
+  bool operator==(const art_slab_allocator<R> &other) const {
+    return arena_ == other.arena_;
+  }
+  template <typename R>
+  bool operator!=(const art_slab_allocator<R> &other) const {
+    return arena_ != other.arena_;
+  }
+
+  static const void *type_key() {
+    static const char key = 0;
+    return &key;
+  }
+  art_slab_pool &type_pool() {
+    if (pool_ == nullptr) {
+      pool_ = &arena_->pool(type_key(), sizeof(T), alignof(T));
+    }
+    return *pool_;
+  }
+
+  std::shared_ptr<art_slab_arena> arena_;
+  art_slab_pool *pool_; // pool of T in arena_, found on first allocation
+};
+
+template <typename A, typename = void>
+struct allocator_has_release : public std::false_type {};
+template <typename A>
+struct allocator_has_release<A, decltype(std::declval<A &>().release())>
+    : public std::true_type {};
+template <typename A, typename = void>
+struct allocator_has_use_count : public std::false_type {};
+template <typename A>
+struct allocator_has_use_count<
+    A, decltype(void(std::declval<const A &>().use_count()))>
+    : public std::true_type {};
+
+// Image of a tree written by art::freeze() and read in place by frozen_art,
+// in host byte order. Node records, entries in key order and the encoded
+// keys follow the header. Record offsets are from the start of the nodes
+// section, where the root comes first.
+struct art_frozen_header {
+  constexpr static char image_magic[8] = "artimg1";
+  constexpr static uint64_t image_byte_order = 0x0102030405060708;
+
+  char magic[8];
+  uint64_t byte_order;
+  uint64_t value_size;
+  uint64_t size;
+  // sections, from the start of the image
+  uint64_t nodes;
+  uint64_t entries;
+  uint64_t keys;
+  uint64_t image_size;
+};
+
+// A node keeps its type. The children follow the record: node4 and node16
+// have their key bytes padded to 8 bytes and the child offsets, node48 its
+// index of 256 bytes, a node_child_bitmap and the offsets, node256 a bitmap
+// and 256 offsets, 0 for no child.
+struct art_frozen_node {
+  enum : uint8_t {
+    node0_type,
+    node4_type,
+    node16_type,
+    node48_type,
+    node256_type
   };
 
-  using node_allocator_traits =
-      typename chain_derived_typelist_container<typename type_list_apply<
-          node_alloca_traits_rebind, levellist<value_type>>::type>::type;
+  uint64_t first; // entry of the first element under the node
+  uint64_t count; // elements under the node
+  uint64_t subfix; // offset in the keys section
+  uint32_t subfix_size;
+  uint16_t children_size;
+  uint8_t type;
+  uint8_t has_value; // the node holds the element at first
+};
 
-  art_tree(const allocator_type &alloc = allocator_type()) : impl_(alloc) {}
+// followed by the mapped value, padded to 8 bytes
+struct art_frozen_entry {
+  uint64_t key; // offset in the keys section
+  uint64_t key_size;
+};
 
-  template <typename node_type> node_type *node_new() {
-    using node_allocator_type = typename std::allocator_traits<
-        Alloc>::template rebind_alloc<node_alloca_helper<node_type>>;
+// Stream written by art::save() and read by art::load(), in host byte order
+// like the frozen image. The header is followed by blocks of records in key
+// order, and an empty block ends the stream. A record is the length of the
+// prefix its key shares with the key before it in the block, the rest of the
+// key and the mapped value, lengths as LEB128 varints. A block is checked by
+// the CRC-32 of its count, its size and its records.
+struct art_dump_header {
+  constexpr static char dump_magic[8] = "artdmp1";
+
+  char magic[8];
+  uint64_t byte_order;
+  uint64_t key_size;   // 0 for keys of any size
+  uint64_t value_size; // 0 for strings
+  uint64_t size;
+};
 
-    node_alloca_helper<node_type> *node =
-        impl_.node_allocator_type::allocate(1);
-    new (node) node_alloca_helper<node_type>();
-    ++impl_.node_counter_;
-    return node;
-  }
-  void node_delete(node_base<value_type> *node) {
-    if (node->storage_valid_) {
-      node->unset_node_value();
+struct art_dump_block {
+  uint32_t count;
+  uint32_t bytes;
+  uint32_t checksum;
+};
+
+struct art_dump {
+  // a block is closed once its records reach this size
+  constexpr static std::size_t block_size = 64 * 1024;
+
+  static void put_varint(std::basic_string<char_type> &out, uint64_t v) {
+    for (; v >= 0x80; v >>= 7) {
+      out.push_back(static_cast<char_type>(v | 0x80));
     }
-    --impl_.node_counter_;
-    node->dealloc(static_cast<void *>(this));
+    out.push_back(static_cast<char_type>(v));
   }
-  bool is_root(node_base<value_type> *node) { return impl_.root_ == node; }
-  find_result_type<value_type> find_last_node(node_base<value_type> *start_node,
-                                              const char_type *subfix,
-                                              std::size_t subfix_size) const {
-    find_result_type<value_type> result;
-    if (start_node == nullptr) {
-      result.node = nullptr;
-      return result;
-    }
-
-    std::size_t cursor = 0;
-    node_base<value_type> *node = start_node;
-    child_slot<value_type> parent_slot;
-    while (true) {
-      if (cursor > subfix_size) {
-        throw "find overflow";
+  static bool get_varint(const char_type *&p, const char_type *end,
+                         uint64_t &v) {
+    v = 0;
+    for (unsigned shift = 0; p != end && shift < 64; shift += 7) {
+      const uint8_t b = static_cast<uint8_t>(*p++);
+      v |= static_cast<uint64_t>(b & 0x7f) << shift;
+      if ((b & 0x80) == 0) {
+        return true;
       }
+    }
+    return false;
+  }
 
-      auto r = node->compare(subfix + cursor, subfix_size - cursor);
-      if (cursor + r.first < subfix_size && r.first == node->subfix_size_) {
-        child_slot<value_type> slot =
-            node->find_child(subfix[cursor + r.first]);
-        if (slot.node != nullptr) {
-          // find next child
-          cursor += r.first + 1;
-          node = *slot.node;
-          parent_slot = slot;
-          continue;
+  static uint32_t crc32(uint32_t crc, const void *data, std::size_t size) {
+    static const auto table = [] {
+      std::array<uint32_t, 256> t;
+      for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) {
+          c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
         }
+        t[i] = c;
       }
-      result = {
-          .node = node,
-          .parent_slot = parent_slot,
-          .key_cur = cursor + r.first,
-          .node_sub_cur = r.first,
-      };
-      return result;
+      return t;
+    }();
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    crc = ~crc;
+    for (std::size_t i = 0; i < size; ++i) {
+      crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
     }
+    return ~crc;
   }
-  void insert_node_link(node_link_base *node, node_link_base *bound_node,
-                        bound_direction direction) {
-    if (direction == lower) {
-      node->next_ = bound_node->next_;
-      node->prev_ = bound_node;
-      bound_node->next_->prev_ = node;
-      bound_node->next_ = node;
-    } else if (direction == upper) {
-      node->next_ = bound_node;
-      node->prev_ = bound_node->prev_;
-      bound_node->prev_->next_ = node;
-      bound_node->prev_ = node;
-    }
+  static uint32_t checksum(const art_dump_block &block,
+                           const std::basic_string<char_type> &records) {
+    uint32_t crc = crc32(0, &block.count, sizeof(block.count));
+    crc = crc32(crc, &block.bytes, sizeof(block.bytes));
+    return crc32(crc, records.data(), records.size());
   }
-  void replace_node_link(node_link_base *node, node_link_base *oldnode) {
+};
+
+// How a mapped value is written in a dump: trivially copyable values as
+// their bytes, strings as a varint length and their characters. get()
+// constructs the value in v, the type needs no default constructor.
+template <typename T, typename = void> struct art_dump_value {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "dump needs a trivially copyable or string mapped_type");
+
+  constexpr static uint64_t value_size = sizeof(T);
+
+  static void put(std::basic_string<char_type> &out, const T &v) {
+    out.append(reinterpret_cast<const char_type *>(&v), sizeof(T));
+  }
+  static bool get(const char_type *&p, const char_type *end,
+                  std::optional<T> &v) {
+    if (static_cast<std::size_t>(end - p) < sizeof(T)) {
+      return false;
+    }
+    alignas(T) unsigned char bytes[sizeof(T)];
+    std::memcpy(bytes, p, sizeof(T));
+    v.emplace(*std::launder(reinterpret_cast<const T *>(bytes)));
+    p += sizeof(T);
+    return true;
+  }
+};
+template <typename Traits, typename A>
+struct art_dump_value<std::basic_string<char_type, Traits, A>> {
+  using string_type = std::basic_string<char_type, Traits, A>;
+
+  constexpr static uint64_t value_size = 0;
+
+  static void put(std::basic_string<char_type> &out, const string_type &v) {
+    art_dump::put_varint(out, v.size());
+    out.append(v.data(), v.size());
+  }
+  static bool get(const char_type *&p, const char_type *end,
+                  std::optional<string_type> &v) {
+    uint64_t size;
+    if (!art_dump::get_varint(p, end, size) ||
+        size > static_cast<uint64_t>(end - p)) {
+      return false;
+    }
+    v.emplace(p, size);
+    p += size;
+    return true;
+  }
+};
+
+// Bytes a key or value keeps on the heap, for strings that do not fit in
+// place and for the bytes of tuple keys. Other types count none.
+template <typename T> struct art_heap_bytes {
+  static std::size_t of(const T &) { return 0; }
+};
+template <typename C, typename Traits, typename A>
+struct art_heap_bytes<std::basic_string<C, Traits, A>> {
+  static std::size_t of(const std::basic_string<C, Traits, A> &v) {
+    const char *data = reinterpret_cast<const char *>(v.data());
+    const char *object = reinterpret_cast<const char *>(&v);
+    if (data >= object && data < object + sizeof(v)) {
+      return 0;
+    }
+    return (v.capacity() + 1) * sizeof(C);
+  }
+};
+template <typename... Ts> struct art_heap_bytes<art_tuple_key<Ts...>> {
+  static std::size_t of(const art_tuple_key<Ts...> &key) {
+    return art_heap_bytes<std::basic_string<char_type>>::of(key.bytes_);
+  }
+};
+
+// Memory and shape of a tree, from art::stats(). Node types are indexed as
+// in levellist, node0 to node256. Bytes are those of the node objects, of the
+// values the inner nodes keep apart and of the heap buffers behind keys and
+// values, without allocator overhead or free slab slots. Depths are of the
+// data nodes, the root at depth 0.
+struct art_stats {
+  constexpr static std::size_t node_types = 5;
+  // subfix_sizes buckets: 0, 1, [2, 4), [4, 8), ... up to 2^32
+  constexpr static std::size_t subfix_buckets = 33;
+
+  static std::size_t subfix_bucket(uint32_t size) {
+    std::size_t b = 0;
+    for (; size != 0; size >>= 1) {
+      ++b;
+    }
+    return b;
+  }
+
+  std::size_t total_nodes() const {
+    std::size_t n = 0;
+    for (std::size_t c : nodes) {
+      n += c;
+    }
+    return n;
+  }
+  std::size_t total_node_bytes() const {
+    std::size_t n = 0;
+    for (std::size_t b : node_bytes) {
+      n += b;
+    }
+    return n;
+  }
+  double average_depth() const {
+    return data_nodes == 0 ? 0 : static_cast<double>(depth_sum) / data_nodes;
+  }
+
+  std::array<std::size_t, node_types> nodes;
+  std::array<std::size_t, node_types> node_bytes;
+  std::size_t inner_nodes; // nodes with children
+  std::size_t data_nodes;  // nodes holding an element, inner ones included
+  std::size_t key_heap_bytes;
+  std::size_t value_heap_bytes;
+  std::size_t value_box_bytes; // values kept apart from inner nodes
+  std::size_t depth_sum;
+  std::size_t max_depth;
+  std::array<std::size_t, 257> fanout; // nodes by number of children
+  std::array<std::size_t, subfix_buckets> subfix_sizes;
+};
+
+// Snapshot bookkeeping of a tree with snapshots. Snapshot g sees the nodes
+// made in generation g or before that were not retired by then, so a node
+// made in born and retired in retired is freed once no open snapshot has a
+// generation in [born, retired). Snapshots may be closed from any thread,
+// nodes are only freed by the thread that writes the tree.
+template <typename Node, bool enabled> struct art_snapshot_state {};
+template <typename Node> struct art_snapshot_state<Node, true> {
+  struct retired_node {
+    Node *node;
+    uint32_t born;
+    uint32_t retired;
+  };
+
+  // The part the snapshot views hold on to, so a view may outlive the tree.
+  // A tree that dies with snapshots open hands over the nodes they may see,
+  // with a copy of its allocators, and the last owner frees them.
+  struct shared_state {
+    shared_state() : closed_(false), free_node_(nullptr) {}
+    ~shared_state() {
+      for (Node *node : orphans_) {
+        free_node_(allocators_.get(), node);
+      }
+    }
+
+    void close_snapshot(uint32_t generation) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      open_.erase(std::find(open_.begin(), open_.end(), generation));
+      closed_ = true;
+    }
+
+    std::mutex mutex_;
+    std::vector<uint32_t> open_;
+    std::atomic<bool> closed_;
+    std::vector<Node *> orphans_;
+    std::shared_ptr<void> allocators_;
+    void (*free_node_)(void *allocators, Node *node);
+  };
+
+  art_snapshot_state()
+      : shared_(std::make_shared<shared_state>()), generation_(1),
+        collect_at_(collect_threshold) {}
+
+  // the generation of a new snapshot, later changes copy what it sees
+  uint32_t open_snapshot() {
+    std::lock_guard<std::mutex> lock(shared_->mutex_);
+    shared_->open_.push_back(generation_);
+    return generation_++;
+  }
+  std::vector<uint32_t> open_generations() {
+    std::lock_guard<std::mutex> lock(shared_->mutex_);
+    return shared_->open_;
+  }
+  // true once after a snapshot is closed
+  bool snapshot_closed() { return shared_->closed_.exchange(false); }
+
+  constexpr static std::size_t collect_threshold = 64;
+
+  std::shared_ptr<shared_state> shared_;
+  std::vector<retired_node> retired_;
+  uint32_t generation_;
+  // retired_ is collected when it grows to this, or after a close
+  std::size_t collect_at_;
+};
+
+template <typename K, typename V, typename Alloc, typename Options>
+struct art_tree {
+  using key_type = K;
+  using mapped_type = typename std::tuple_element<1, V>::type;
+  using value_type = std::pair<const key_type, mapped_type>;
+  using allocator_type = Alloc;
+  using key_traits = art_key_traits<key_type>;
+
+  // the nodes of this tree, made with its options
+  template <typename T> using node_base = ::node_base<T, Options>;
+  template <typename T> using node0 = ::node0<T, Options>;
+  template <typename T> using node4 = ::node4<T, Options>;
+  template <typename T> using node16 = ::node16<T, Options>;
+  template <typename T> using node48 = ::node48<T, Options>;
+  template <typename T> using node256 = ::node256<T, Options>;
+  template <typename T> using child_slot = ::child_slot<T, Options>;
+  template <typename T>
+  using find_result_type = ::find_result_type<T, Options>;
+  template <typename T> using levellist = ::levellist<T, Options>;
+  template <typename T> using node_inner = ::node_inner<T, Options>;
+  // the node types, and the values inner nodes keep apart
+  using allocator_list =
+      typename type_list_append<levellist<value_type>, value_type>::type;
+
+  template <typename node_type>
+  struct node_alloca_traits_rebind
+      : public std::allocator_traits<Alloc>::template rebind_alloc<node_type> {
+    using traits =
+        typename std::allocator_traits<Alloc>::template rebind_alloc<node_type>;
+    using traits::traits;
+    // the value allocator is Alloc itself, which no constructor inherits
+    template <typename A, typename = typename std::enable_if<
+                              std::is_same<A, Alloc>::value>::type>
+    node_alloca_traits_rebind(const A &alloc) : traits(alloc) {}
+  };
+
+  using node_allocator_traits =
+      typename chain_derived_typelist_container<typename type_list_apply<
+          node_alloca_traits_rebind, allocator_list>::type>::type;
+
+  art_tree(const allocator_type &alloc = allocator_type()) : impl_(alloc) {}
+  // the retired nodes open snapshots may still see go to their shared state
+  ~art_tree() {
+    if constexpr (Options::snapshots) {
+      if (impl_.retired_.empty()) {
+        return;
+      }
+      auto &shared = *impl_.shared_;
+      shared.allocators_ = std::make_shared<node_allocator_traits>(impl_);
+      shared.free_node_ = [](void *allocators, node_base<value_type> *node) {
+        node_free(*static_cast<node_allocator_traits *>(allocators), node);
+      };
+      for (const auto &r : impl_.retired_) {
+        shared.orphans_.push_back(r.node);
+      }
+    }
+  }
+
+  template <typename node_type> node_type *node_new() {
+    using node_allocator_type = node_alloca_traits_rebind<node_type>;
+
+    node_type *node = impl_.node_allocator_type::allocate(1);
+    new (node) node_type();
+    node->type_ = node_base<value_type>::template type_of<node_type>();
+    if constexpr (Options::snapshots) {
+      node->set_generation(impl_.generation_);
+    }
+    ++impl_.node_counter_;
+    ++impl_.node_type_counter_[node->type_];
+    return node;
+  }
+  // allocate the next node type in levellist
+  node_base<value_type> *node_expand_new(node_base<value_type> *node) {
+    return node_visit(node, [this](auto *n) -> node_base<value_type> * {
+      using node_type = typename std::remove_pointer<decltype(n)>::type;
+      return node_new<typename levellist<value_type>::template get_type<
+          levellist<value_type>::template find<node_type>() + 1>>();
+    });
+  }
+  // allocate the previous node type in levellist
+  node_base<value_type> *node_shrink_new(node_base<value_type> *node) {
+    return node_visit(node, [this](auto *n) -> node_base<value_type> * {
+      using node_type = typename std::remove_pointer<decltype(n)>::type;
+      constexpr std::size_t level =
+          levellist<value_type>::template find<node_type>();
+      if (level == 0) {
+        throw "node0 shrink";
+      }
+      return node_new<typename levellist<value_type>::template get_type<
+          level == 0 ? 0 : level - 1>>();
+    });
+  }
+  void node_delete(node_base<value_type> *node) {
+    --impl_.node_counter_;
+    --impl_.node_type_counter_[node->type_];
+    node_free(impl_, node);
+  }
+  // destroy node and give it back to its allocator in allocators
+  static void node_free(node_allocator_traits &allocators,
+                        node_base<value_type> *node) {
+    node->clear_node_storage();
+    node_value_free(allocators, node);
+    node_visit(node, [&allocators](auto *n) {
+      using node_type = typename std::remove_pointer<decltype(n)>::type;
+      using node_allocator_type = node_alloca_traits_rebind<node_type>;
+      n->~node_type();
+      static_cast<node_allocator_type &>(allocators).deallocate(n, 1);
+    });
+  }
+  // An inner node gets the box for its value first, see node_inner. Every
+  // value is set through here or node_move_value.
+  template <typename... Args>
+  void node_emplace_value(node_base<value_type> *node, Args &&...args) {
+    if (!node->value_boxed()) {
+      node->emplace_node_value(std::forward<Args>(args)...);
+      return;
+    }
+    using value_allocator = node_alloca_traits_rebind<value_type>;
+    value_type *&box = static_cast<node_inner<value_type> *>(node)->value_;
+    box = impl_.value_allocator::allocate(1);
+    try {
+      node->emplace_node_value(std::forward<Args>(args)...);
+    } catch (...) {
+      impl_.value_allocator::deallocate(box, 1);
+      box = nullptr;
+      throw;
+    }
+  }
+  void node_unset_value(node_base<value_type> *node) {
+    node->unset_node_value();
+    node_value_free(impl_, node);
+  }
+  // the value of node goes to new_node, a box is handed over as it is
+  void node_move_value(node_base<value_type> *node,
+                       node_base<value_type> *new_node) {
+    if (!node->value_boxed() || !new_node->value_boxed()) {
+      node_emplace_value(new_node, std::move(node->get_value()));
+      node->clear_node_storage();
+      node_value_free(impl_, node);
+      return;
+    }
+    std::swap(static_cast<node_inner<value_type> *>(node)->value_,
+              static_cast<node_inner<value_type> *>(new_node)->value_);
+    new_node->storage_valid_ = true;
+    node->storage_valid_ = false;
+  }
+  static void node_value_free(node_allocator_traits &allocators,
+                              node_base<value_type> *node) {
+    if (!node->value_boxed()) {
+      return;
+    }
+    using value_allocator = node_alloca_traits_rebind<value_type>;
+    value_type *&box = static_cast<node_inner<value_type> *>(node)->value_;
+    if (box != nullptr) {
+      static_cast<value_allocator &>(allocators).deallocate(box, 1);
+      box = nullptr;
+    }
+  }
+  bool is_root(node_base<value_type> *node) { return impl_.root_ == node; }
+  static find_result_type<value_type>
+  find_last_node(node_base<value_type> *start_node, const char_type *subfix,
+                 std::size_t subfix_size) {
+    find_result_type<value_type> result{};
+    if (start_node == nullptr) {
+      result.node = nullptr;
+      return result;
+    }
+
+    std::size_t cursor = 0;
+    node_base<value_type> *node = start_node;
+    child_slot<value_type> parent_slot{};
+    while (true) {
+      if (cursor > subfix_size) {
+        throw "find overflow";
+      }
+
+      auto r = node->compare(subfix + cursor, subfix_size - cursor);
+      if (cursor + r.first < subfix_size && r.first == node->subfix_size_) {
+        child_slot<value_type> slot =
+            node->find_child(subfix[cursor + r.first]);
+        if (slot.node != nullptr) {
+          // find next child
+          cursor += r.first + 1;
+          node = *slot.node;
+          parent_slot = slot;
+          continue;
+        }
+      }
+      result = {
+          .node = node,
+          .parent_slot = parent_slot,
+          .key_cur = cursor + r.first,
+          .node_sub_cur = r.first,
+      };
+      return result;
+    }
+  }
+  // Iterators go along the list of data nodes, dummy_ is the end. Without
+  // links a position is the data node itself and the end is nullptr.
+  using link_type =
+      typename std::conditional<Options::linked, node_link_base,
+                                node_base<value_type>>::type;
+  link_type *first_link() const {
+    if constexpr (Options::linked) {
+      return impl_.dummy_.next_;
+    } else {
+      return impl_.root_ == nullptr ? nullptr
+                                    : impl_.root_->find_min_data_node();
+    }
+  }
+  link_type *end_link() const {
+    if constexpr (Options::linked) {
+      return const_cast<node_link_base *>(&impl_.dummy_);
+    } else {
+      return nullptr;
+    }
+  }
+  static link_type *next_link(const link_type *l) {
+    if constexpr (Options::linked) {
+      return l->next_;
+    } else {
+      return const_cast<link_type *>(l)->next_data_node();
+    }
+  }
+  // tree is only read to step back from the end without links
+  static link_type *prev_link(const art_tree *tree, const link_type *l) {
+    if constexpr (Options::linked) {
+      return l->prev_;
+    } else {
+      if (l == nullptr) {
+        return tree->impl_.root_->find_max_data_node();
+      }
+      return const_cast<link_type *>(l)->prev_data_node();
+    }
+  }
+  // the list functions below are only called in linked trees
+  void insert_node_link(node_link_base *node, node_link_base *bound_node,
+                        bound_direction direction) {
+    if (direction == lower) {
+      node->next_ = bound_node->next_;
+      node->prev_ = bound_node;
+      bound_node->next_->prev_ = node;
+      bound_node->next_ = node;
+    } else if (direction == upper) {
+      node->next_ = bound_node;
+      node->prev_ = bound_node->prev_;
+      bound_node->prev_->next_ = node;
+      bound_node->prev_ = node;
+    }
+  }
+  void replace_node_link(node_link_base *node, node_link_base *oldnode) {
     node->prev_ = oldnode->prev_;
     node->next_ = oldnode->next_;
     oldnode->prev_->next_ = node;
@@ -536,6 +1773,30 @@ template <typename K, typename V, typename Alloc> struct art_tree {
     node->prev_->next_ = node->next_;
     node->next_->prev_ = node->prev_;
   }
+  // link new_node, just inserted as child c of node, next to its siblings
+  void insert_child_link(node_base<value_type> *node, char_type c,
+                         node_base<value_type> *new_node) {
+    child_slot<value_type> slot{};
+
+    // first find greater child in this node
+    slot = node->find_greater_child(c);
+    if (slot.node != nullptr) {
+      // find min data node
+      insert_node_link(new_node, (*slot.node)->find_min_data_node(), upper);
+      return;
+    }
+
+    // second find less child in this node
+    slot = node->find_less_child(c);
+    if (slot.node != nullptr) {
+      // find max data node
+      insert_node_link(new_node, (*slot.node)->find_max_data_node(), lower);
+      return;
+    }
+
+    // no other child, this node must has data
+    insert_node_link(new_node, node, lower);
+  }
   void change_node_parent_child(node_base<value_type> *node,
                                 node_base<value_type> *oldnode,
                                 node_base<value_type> **child_slot) {
@@ -547,44 +1808,178 @@ template <typename K, typename V, typename Alloc> struct art_tree {
       node->parent_c_ = oldnode->parent_c_;
     }
   }
+  // an element is added to or removed from node, count it in node and its
+  // ancestors when the tree keeps subtree counts
+  void add_subtree_count(node_base<value_type> *node, std::ptrdiff_t n) {
+    if (!Options::subtree_counts) {
+      return;
+    }
+    for (; node != nullptr; node = node->parent_) {
+      node->set_subtree_count(node->subtree_count() + n);
+    }
+  }
+  // move children, value, link and subfix of node to new_node
+  node_base<value_type> *node_move(node_base<value_type> *node,
+                                   node_base<value_type> *new_node) {
+    child_slot<value_type> slots[256];
+    int slot_size = node->get_all_children(slots);
+    for (int i = 0; i < slot_size; ++i) {
+      new_node->try_insert_child(slots[i].c, *slots[i].node);
+    }
+    if (node->storage_valid_) {
+      node_move_value(node, new_node);
+      if constexpr (Options::linked) {
+        replace_node_link(new_node, node);
+      }
+      new_node->set_node_subfix(nullptr, node->subfix_size_);
+    } else {
+      new_node->set_node_subfix(node->subfix_head(), node->subfix_size_);
+    }
+    new_node->set_subtree_count(node->subtree_count());
+    return new_node;
+  }
   node_base<value_type> *node_expand(node_base<value_type> *node) {
-    node_base<value_type> *expanded_node =
-        node->expand_new(static_cast<void *>(this));
+    return node_move(node, node_expand_new(node));
+  }
+
+  // Copy on write for snapshots. Nodes made before the last snapshot may be
+  // seen by it, so a change copies them first, from the root down, and the
+  // copies belong to the live tree only. Snapshots read from their root
+  // down, so parent_, links and counts of shared nodes are kept for the live
+  // tree. The ancestors of an owned node are owned.
+  bool node_owned(const node_base<value_type> *node) const {
+    if constexpr (Options::snapshots) {
+      return node->generation() == impl_.generation_;
+    } else {
+      return true;
+    }
+  }
+  // same type, children, value, link and subfix as node
+  node_base<value_type> *node_copy(node_base<value_type> *node) {
+    node_base<value_type> *copy =
+        node_visit(node, [this](auto *n) -> node_base<value_type> * {
+          return node_new<typename std::remove_pointer<decltype(n)>::type>();
+        });
     child_slot<value_type> slots[256];
     int slot_size = node->get_all_children(slots);
     for (int i = 0; i < slot_size; ++i) {
-      expanded_node->try_insert_child(slots[i].c, *slots[i].node);
+      copy->try_insert_child(slots[i].c, *slots[i].node);
     }
     if (node->storage_valid_) {
-      expanded_node->move_node_value(std::move(node->get_value()));
-      node->unset_node_value();
-      replace_node_link(expanded_node, node);
+      node_emplace_value(copy, node->get_value());
+      if constexpr (Options::linked) {
+        replace_node_link(copy, node);
+      }
+    }
+    copy->set_node_subfix(node->subfix_head(), node->subfix_size_);
+    copy->set_subtree_count(node->subtree_count());
+    return copy;
+  }
+  // make node and its ancestors owned, returns the node now in its place
+  node_base<value_type> *own_path(node_base<value_type> *node) {
+    if (node_owned(node)) {
+      return node;
+    }
+    if constexpr (Options::snapshots) {
+      std::vector<node_base<value_type> *> path;
+      for (; !node_owned(node); node = node->parent_) {
+        path.push_back(node);
+        if (is_root(node)) {
+          break;
+        }
+      }
+      for (auto it = path.rbegin(); it != path.rend(); ++it) {
+        node_base<value_type> *shared = *it;
+        node = node_copy(shared);
+        change_node_parent_child(
+            node, shared,
+            is_root(shared)
+                ? nullptr
+                : shared->parent_->find_child(shared->parent_c_).node);
+        retire_node(shared);
+      }
+    }
+    return node;
+  }
+  // free a node taken out of the tree, or keep it for the snapshots that
+  // may see it
+  void retire_node(node_base<value_type> *node) {
+    if constexpr (Options::snapshots) {
+      if (!node_owned(node)) {
+        impl_.retired_.push_back(
+            {node, node->generation(), impl_.generation_});
+        return;
+      }
+    }
+    node_delete(node);
+  }
+  // free the retired nodes no open snapshot sees. Not done while a change is
+  // under way, the key of a change may point into a retired node.
+  void collect_retired() {
+    const std::vector<uint32_t> open = impl_.open_generations();
+    std::size_t w = 0;
+    for (const auto &r : impl_.retired_) {
+      const bool seen =
+          std::any_of(open.begin(), open.end(), [&](uint32_t generation) {
+            return r.born <= generation && generation < r.retired;
+          });
+      if (seen) {
+        impl_.retired_[w++] = r;
+      } else {
+        node_delete(r.node);
+      }
+    }
+    impl_.retired_.resize(w);
+    impl_.collect_at_ = std::max(impl_.collect_threshold, 2 * w);
+  }
+  void try_collect_retired() {
+    if constexpr (Options::snapshots) {
+      if (impl_.retired_.size() >= impl_.collect_at_ ||
+          impl_.snapshot_closed()) {
+        collect_retired();
+      }
+    }
+  }
+  node_base<value_type> *node_shrink(node_base<value_type> *node) {
+    return node_move(node, node_shrink_new(node));
+  }
+  // replace node with a smaller node type once enough children are erased
+  void node_try_shrink(node_base<value_type> *node) {
+    const int shrink_size = node_visit(
+        node, [](auto *n) -> int { return n->shrink_children_size; });
+    if (node->children_size_ > shrink_size) {
+      return;
     }
-    expanded_node->set_node_subfix(node->subfix_start_, node->subfix_size_);
-    return expanded_node;
+
+    node_base<value_type> **parent_slot =
+        is_root(node) ? nullptr
+                      : node->parent_->find_child(node->parent_c_).node;
+    node_base<value_type> *shrunk_node = node_shrink(node);
+    change_node_parent_child(shrunk_node, node, parent_slot);
+    node_delete(node);
   }
   void erase_node_with_one_child(node_base<value_type> *node,
                                  node_base<value_type> **child_slot_ptr) {
     child_slot<value_type> slot = node->find_min_child();
-    node_base<value_type> *child = *slot.node;
-    key_type new_child_subfix;
-    new_child_subfix.reserve(node->subfix_size_ + 1 + child->subfix_size_);
-    new_child_subfix.append(node->subfix_start_, node->subfix_size_);
-    new_child_subfix.append(1, slot.c);
-    new_child_subfix.append(child->subfix_start_, child->subfix_size_);
-    child->set_node_subfix(new_child_subfix.c_str(), new_child_subfix.size());
+    // the subfix of child changes
+    node_base<value_type> *child = own_path(*slot.node);
+    child->prepend_node_subfix(node, slot.c);
 
     change_node_parent_child(child, node, child_slot_ptr);
 
     node_delete(node);
   }
 
-  std::pair<node_base<value_type> *, bool> find(const key_type &_key) const {
-    const std::size_t key_size = _key.size();
-    const char_type *key = _key.c_str();
-
+  std::pair<node_base<value_type> *, bool>
+  find(const char_type *key, std::size_t key_size) const {
+    return find(impl_.root_, key, key_size);
+  }
+  // find under root, the root of the tree or of a snapshot
+  static std::pair<node_base<value_type> *, bool>
+  find(node_base<value_type> *root, const char_type *key,
+       std::size_t key_size) {
     find_result_type<value_type> find_result =
-        find_last_node(impl_.root_, key, key_size);
+        find_last_node(root, key, key_size);
     if (find_result.node && find_result.key_cur == key_size &&
         find_result.node_sub_cur == find_result.node->subfix_size_ &&
         find_result.node->storage_valid_) {
@@ -593,114 +1988,207 @@ template <typename K, typename V, typename Alloc> struct art_tree {
     return {nullptr, false};
   }
 
+  // Batched find. Up to multi_find_group lookups walk down in lockstep: each
+  // one prefetches the node it goes to next and hands over to the next
+  // lookup, so their cache misses overlap instead of stalling one by one.
+  // found(i, node) is called for each key, node is nullptr if not found.
+  template <typename Key, typename F>
+  void multi_find(const Key *keys, std::size_t n, F &&found) const {
+    struct lookup {
+      decltype(key_traits::encode(std::declval<const Key &>())) key;
+      std::size_t cursor;
+      node_base<value_type> *node;
+      std::size_t index;
+      bool subfix_ready; // the out of line subfix of node is prefetched
+    };
+
+    std::size_t next = 0;
+    auto start = [&](lookup &l) {
+      if (next == n || impl_.root_ == nullptr) {
+        for (; next < n; ++next) {
+          found(next, nullptr);
+        }
+        return false;
+      }
+      l = {key_traits::encode(keys[next]), 0, impl_.root_, next++, false};
+      return true;
+    };
+
+    lookup group[multi_find_group];
+    std::size_t active = 0;
+    while (active < multi_find_group && start(group[active])) {
+      ++active;
+    }
+
+    std::size_t g = 0;
+    while (active > 0) {
+      if (g >= active) {
+        g = 0;
+      }
+      lookup &l = group[g];
+      node_base<value_type> *node = l.node;
+      if (!l.subfix_ready && node->storage_valid_ &&
+          node->subfix_size_ > node_base<value_type>::subfix_inline_capacity) {
+        __builtin_prefetch(node->subfix_start_);
+        l.subfix_ready = true;
+        ++g;
+        continue;
+      }
+
+      const char_type *key = l.key.data();
+      const std::size_t key_size = l.key.size();
+      auto r = node->compare(key + l.cursor, key_size - l.cursor);
+      if (l.cursor + r.first < key_size && r.first == node->subfix_size_) {
+        child_slot<value_type> slot = node->find_child(key[l.cursor + r.first]);
+        if (slot.node != nullptr) {
+          l.cursor += r.first + 1;
+          l.node = *slot.node;
+          l.subfix_ready = false;
+          __builtin_prefetch(l.node);
+          __builtin_prefetch(&l.node->type_);
+          ++g;
+          continue;
+        }
+      }
+
+      const bool hit = l.cursor + r.first == key_size &&
+                       r.first == node->subfix_size_ && node->storage_valid_;
+      found(l.index, hit ? node : nullptr);
+      if (start(l)) {
+        ++g;
+      } else {
+        // the last lookup moves here and goes next
+        l = group[--active];
+      }
+    }
+  }
+  constexpr static std::size_t multi_find_group = 16;
+
   std::pair<node_base<value_type> *, bool> insert(const value_type &value) {
-    const std::size_t key_size = value.first.size();
-    const char_type *key = value.first.c_str();
+    const auto key = key_traits::encode(value.first);
+    return emplace(key.data(), key.size(), value);
+  }
 
+  // The value is constructed in place from args, only when key is not found.
+  // args may own the key memory, so key is not read after the value is made.
+  template <typename... Args>
+  std::pair<node_base<value_type> *, bool>
+  emplace(const char_type *key, std::size_t key_size, Args &&...args) {
+    try_collect_retired();
     if (impl_.root_ == nullptr) {
-      impl_.root_ = node_new<node4<value_type>>();
-      impl_.root_->set_node_value(value);
+      impl_.root_ = node_new<node0<value_type>>();
+      node_emplace_value(impl_.root_, std::forward<Args>(args)...);
       impl_.root_->set_node_subfix(key, key_size);
-      insert_node_link(impl_.root_, &impl_.dummy_, lower);
+      if constexpr (Options::linked) {
+        insert_node_link(impl_.root_, &impl_.dummy_, lower);
+      }
 
+      impl_.root_->set_subtree_count(1);
       ++impl_.size_;
       return {impl_.root_, true};
     }
 
-    const find_result_type<value_type> find_result =
+    find_result_type<value_type> find_result =
         find_last_node(impl_.root_, key, key_size);
+    if (find_result.key_cur == key_size &&
+        find_result.node_sub_cur == find_result.node->subfix_size_ &&
+        find_result.node->storage_valid_) {
+      // insert failed, because key is existed. A caller that writes the
+      // value owns the node first.
+      return {find_result.node, false};
+    }
+    if (!node_owned(find_result.node)) {
+      // the node changes
+      find_result.node = own_path(find_result.node);
+      find_result.parent_slot.node =
+          is_root(find_result.node)
+              ? nullptr
+              : find_result.node->parent_
+                    ->find_child(find_result.node->parent_c_)
+                    .node;
+    }
     node_base<value_type> *node = find_result.node;
     const char_type *subfix = key + find_result.key_cur;
     const std::size_t subfix_size = key_size - find_result.key_cur;
 
     if (find_result.node_sub_cur == node->subfix_size_ && subfix_size == 0) {
-      // find this node
-      if (node->storage_valid_) {
-        // insert failed, because key is existed
-        return {node, false};
-      }
-      node->set_node_value(value);
-      // here need reset subfix start
-      node->set_node_subfix(node->subfix_start_, node->subfix_size_);
+      // find this node, it has no value
+      node_emplace_value(node, std::forward<Args>(args)...);
 
       // this node is no data before, so it must has children. The key of
       // the child is greater than this node.
-      insert_node_link(
-          node, (*node->find_min_child().node)->find_min_data_node(), upper);
+      if constexpr (Options::linked) {
+        insert_node_link(
+            node, (*node->find_min_child().node)->find_min_data_node(),
+            upper);
+      }
+
+      add_subtree_count(node, 1);
 
       ++impl_.size_;
+
       return {node, true};
     }
 
     if (find_result.node_sub_cur < node->subfix_size_ && subfix_size > 0) {
       // split node, make parent node and hold this node
+      const char_type c = subfix[0];
       node_base<value_type> *new_parent_node = node_new<node4<value_type>>();
-      node_base<value_type> *new_child_node = node_new<node4<value_type>>();
-      new_child_node->set_node_value(value);
+      new_parent_node->set_subtree_count(node->subtree_count());
+      node_base<value_type> *new_child_node = node_new<node0<value_type>>();
+      node_emplace_value(new_child_node, std::forward<Args>(args)...);
 
-      new_parent_node->set_node_subfix(node->subfix_start_,
+      new_parent_node->set_node_subfix(node->subfix(),
                                        find_result.node_sub_cur);
-      new_child_node->set_node_subfix(subfix + 1, subfix_size - 1);
+      new_child_node->set_node_subfix(nullptr, subfix_size - 1);
 
       change_node_parent_child(new_parent_node, node,
                                find_result.parent_slot.node);
 
-      char_type node_key_c = node->subfix_start_[find_result.node_sub_cur];
+      char_type node_key_c = node->subfix()[find_result.node_sub_cur];
 
       new_parent_node->try_insert_child(node_key_c, node);
-      new_parent_node->try_insert_child(subfix[0], new_child_node);
+      new_parent_node->try_insert_child(c, new_child_node);
 
       node->truncate_node_prefix(find_result.node_sub_cur + 1);
 
       // search from parent node, find data node which key greater than target
       // or less tahn target.
 
-      if (node_key_c > subfix[0]) {
-        // the key of this node greater than target, find min data node from
-        // this node
-        insert_node_link(new_child_node, node->find_min_data_node(), upper);
-      } else {
-        // must not equal
-        // the key of this node less than target, find max data node from this
-        // node
-        insert_node_link(new_child_node, node->find_max_data_node(), lower);
+      if constexpr (Options::linked) {
+        if (node_key_c > c) {
+          // the key of this node greater than target, find min data node
+          // from this node
+          insert_node_link(new_child_node, node->find_min_data_node(), upper);
+        } else {
+          // must not equal
+          // the key of this node less than target, find max data node from
+          // this node
+          insert_node_link(new_child_node, node->find_max_data_node(), lower);
+        }
       }
 
+      add_subtree_count(new_child_node, 1);
+
       ++impl_.size_;
+
       return {new_child_node, true};
     }
 
     if (find_result.node_sub_cur == node->subfix_size_ && subfix_size > 0) {
       // append to this node child
-      node_base<value_type> *new_node = node_new<node4<value_type>>();
-      new_node->set_node_value(value);
-      new_node->set_node_subfix(subfix + 1, subfix_size - 1);
+      const char_type c = subfix[0];
+      node_base<value_type> *new_node = node_new<node0<value_type>>();
+      node_emplace_value(new_node, std::forward<Args>(args)...);
+      new_node->set_node_subfix(nullptr, subfix_size - 1);
 
     re_insert:
-      const auto r1 = node->try_insert_child(subfix[0], new_node);
+      const auto r1 = node->try_insert_child(c, new_node);
       if (r1.second) {
-        child_slot<value_type> slot;
-
-        // first find greater child in this node
-        slot = node->find_greater_child(subfix[0]);
-        if (slot.node != nullptr) {
-          // find min data node
-          insert_node_link(new_node, (*slot.node)->find_min_data_node(), upper);
-          ++impl_.size_;
-          return {new_node, true};
-        }
-
-        // second find less child in this node
-        slot = node->find_less_child(subfix[0]);
-        if (slot.node != nullptr) {
-          // find max data node
-          insert_node_link(new_node, (*slot.node)->find_max_data_node(), lower);
-          ++impl_.size_;
-          return {new_node, true};
+        if constexpr (Options::linked) {
+          insert_child_link(node, c, new_node);
         }
-
-        // no other child, this node must has data
-        insert_node_link(new_node, node, lower);
+        add_subtree_count(new_node, 1);
         ++impl_.size_;
         return {new_node, true};
       } else {
@@ -718,34 +2206,37 @@ template <typename K, typename V, typename Alloc> struct art_tree {
     if (find_result.node_sub_cur < node->subfix_size_ && subfix_size == 0) {
       // split node, but parent is target node
       node_base<value_type> *new_parent_node = node_new<node4<value_type>>();
-      new_parent_node->set_node_value(value);
+      new_parent_node->set_subtree_count(node->subtree_count());
+      node_emplace_value(new_parent_node, std::forward<Args>(args)...);
 
-      new_parent_node->set_node_subfix(node->subfix_start_,
+      new_parent_node->set_node_subfix(node->subfix(),
                                        find_result.node_sub_cur);
 
       change_node_parent_child(new_parent_node, node,
                                find_result.parent_slot.node);
 
       new_parent_node->try_insert_child(
-          node->subfix_start_[find_result.node_sub_cur], node);
+          node->subfix()[find_result.node_sub_cur], node);
 
       node->truncate_node_prefix(find_result.node_sub_cur + 1);
 
       // find the min data node
-      insert_node_link(new_parent_node, node->find_min_data_node(), upper);
+      if constexpr (Options::linked) {
+        insert_node_link(new_parent_node, node->find_min_data_node(), upper);
+      }
+
+      add_subtree_count(new_parent_node, 1);
 
       ++impl_.size_;
+
       return {new_parent_node, true};
     }
 
     throw "bad judge";
   }
 
-  std::pair<const node_link_base *, bool>
-  lower_bound(const key_type &_key) const {
-    const std::size_t key_size = _key.size();
-    const char_type *key = _key.c_str();
-
+  std::pair<const link_type *, bool>
+  lower_bound(const char_type *key, std::size_t key_size) const {
     if (impl_.root_ == nullptr) {
       return {nullptr, false};
     }
@@ -767,17 +2258,17 @@ template <typename K, typename V, typename Alloc> struct art_tree {
     }
 
     if (find_result.node_sub_cur < node->subfix_size_ && subfix_size > 0) {
-      char_type node_key_c = node->subfix_start_[find_result.node_sub_cur];
+      char_type node_key_c = node->subfix()[find_result.node_sub_cur];
       if (node_key_c > subfix[0]) {
         node_base<value_type> *upper_node = node->find_min_data_node();
         return {upper_node, false};
       }
       node_base<value_type> *lower_node = node->find_max_data_node();
-      return {lower_node->next_, false};
+      return {next_link(lower_node), false};
     }
 
     if (find_result.node_sub_cur == node->subfix_size_ && subfix_size > 0) {
-      child_slot<value_type> slot;
+      child_slot<value_type> slot{};
       // first find greater child in this node
       slot = node->find_greater_child(subfix[0]);
       if (slot.node != nullptr) {
@@ -789,11 +2280,11 @@ template <typename K, typename V, typename Alloc> struct art_tree {
       slot = node->find_less_child(subfix[0]);
       if (slot.node != nullptr) {
         node_base<value_type> *lower_node = (*slot.node)->find_max_data_node();
-        return {lower_node->next_, false};
+        return {next_link(lower_node), false};
       }
 
       // no other child, this node must has data, but this key is less
-      return {node->next_, false};
+      return {next_link(node), false};
     }
 
     if (find_result.node_sub_cur < node->subfix_size_ && subfix_size == 0) {
@@ -804,14 +2295,113 @@ template <typename K, typename V, typename Alloc> struct art_tree {
     throw "bad judge";
   }
 
+  // The keys that start with prefix are exactly those under the node the
+  // prefix ends in, so the first and last data nodes of that subtree bound
+  // them. Both are nullptr if no key starts with prefix.
+  std::pair<node_base<value_type> *, node_base<value_type> *>
+  prefix_range(const char_type *prefix, std::size_t prefix_size) const {
+    const find_result_type<value_type> find_result =
+        find_last_node(impl_.root_, prefix, prefix_size);
+    if (find_result.node == nullptr || find_result.key_cur != prefix_size) {
+      return {nullptr, nullptr};
+    }
+    return {find_result.node->find_min_data_node(),
+            find_result.node->find_max_data_node()};
+  }
+
+  // Order statistics from the subtree counts, in O(key length) node visits.
+  // rank is the number of keys less than key.
+  std::size_t rank(const char_type *key, std::size_t key_size) const {
+    static_assert(Options::subtree_counts, "rank needs art_options<true>");
+    std::size_t rank = 0;
+    std::size_t cursor = 0;
+    node_base<value_type> *node = impl_.root_;
+    child_slot<value_type> slots[256];
+    while (node != nullptr) {
+      auto r = node->compare(key + cursor, key_size - cursor);
+      cursor += r.first;
+      if (r.first < node->subfix_size_) {
+        // the subtree is all greater or all less than key
+        if (cursor < key_size && key[cursor] > node->subfix()[r.first]) {
+          rank += node->subtree_count();
+        }
+        return rank;
+      }
+      if (cursor == key_size) {
+        return rank;
+      }
+
+      // the key of node is a prefix of key, and so are the keys before c
+      const char_type c = key[cursor++];
+      rank += node->storage_valid_ ? 1 : 0;
+      const int slot_size = node->get_all_children(slots);
+      node = nullptr;
+      for (int i = 0; i < slot_size && slots[i].c <= c; ++i) {
+        if (slots[i].c == c) {
+          node = *slots[i].node;
+        } else {
+          rank += (*slots[i].node)->subtree_count();
+        }
+      }
+    }
+    return rank;
+  }
+  // the data node of the element at index i in key order, i < size
+  node_base<value_type> *select(std::size_t i) const {
+    static_assert(Options::subtree_counts, "select needs art_options<true>");
+    node_base<value_type> *node = impl_.root_;
+    child_slot<value_type> slots[256];
+    while (true) {
+      if (node->storage_valid_) {
+        if (i == 0) {
+          return node;
+        }
+        --i;
+      }
+      const int slot_size = node->get_all_children(slots);
+      for (int k = 0; k < slot_size; ++k) {
+        node_base<value_type> *child = *slots[k].node;
+        if (i < child->subtree_count()) {
+          node = child;
+          break;
+        }
+        i -= child->subtree_count();
+      }
+    }
+  }
+  std::size_t count_prefix(const char_type *prefix,
+                           std::size_t prefix_size) const {
+    static_assert(Options::subtree_counts,
+                  "count_prefix needs art_options<true>");
+    const find_result_type<value_type> find_result =
+        find_last_node(impl_.root_, prefix, prefix_size);
+    if (find_result.node == nullptr || find_result.key_cur != prefix_size) {
+      return 0;
+    }
+    return find_result.node->subtree_count();
+  }
+
   void erase(node_base<value_type> *node) {
     if (!node->storage_valid_) {
       throw "erase no data node";
     }
+    try_collect_retired();
+    // a leaf is taken out as it is, only the path above it changes
+    const bool leaf = node->children_size_ == 0;
+    if (!leaf) {
+      node = own_path(node);
+    } else if (!is_root(node)) {
+      own_path(node->parent_);
+    }
 
     --impl_.size_;
-    node->unset_node_value();
-    erase_node_link(node);
+    add_subtree_count(leaf ? node->parent_ : node, -1);
+    if (!leaf) {
+      node_unset_value(node);
+    }
+    if constexpr (Options::linked) {
+      erase_node_link(node);
+    }
 
     if (node->children_size_ > 1) {
       return;
@@ -825,7 +2415,7 @@ template <typename K, typename V, typename Alloc> struct art_tree {
         }
 
         // node->children_size_ == 0, erase root node
-        node_delete(node);
+        retire_node(node);
         impl_.root_ = nullptr;
         return;
       }
@@ -847,23 +2437,521 @@ template <typename K, typename V, typename Alloc> struct art_tree {
       if (parent_node->storage_valid_ || parent_node->children_size_ > 2) {
         // delete child of parent
         parent_node->erase_child(parent_slot.c);
-        node_delete(node);
+        retire_node(node);
+        node_try_shrink(parent_node);
         return;
       }
 
       // parent_node->children_size_ == 2
       parent_node->erase_child(parent_slot.c);
-      node_delete(node);
+      retire_node(node);
       // need replace parent to the other child of parent
       // point parent to node, that mean erase parent
       node = parent_node;
     }
   }
 
+  // The node allocators can drop all their memory at once if they have
+  // release() and no allocator outside this tree shares it.
+  bool node_allocators_owned() const {
+    using node4_allocator = node_alloca_traits_rebind<node4<value_type>>;
+    if constexpr (!allocator_has_release<node4_allocator>::value) {
+      return false;
+    } else if constexpr (allocator_has_use_count<node4_allocator>::value) {
+      return static_cast<const node4_allocator &>(impl_).use_count() ==
+             static_cast<long>(allocator_list::size);
+    } else {
+      return true;
+    }
+  }
+
+  // Free the whole tree in one pass. Nodes are not unlinked or re-compressed
+  // one by one, and when the allocator can drop its arena the nodes are only
+  // destroyed, or not visited at all if that is a no-op.
+  void clear() {
+    const bool owned = node_allocators_owned();
+    // nodes a snapshot may see are kept, so no arena is dropped
+    const bool arena = !Options::snapshots && owned;
+    constexpr bool trivial =
+        std::is_trivially_destructible<value_type>::value &&
+        std::is_trivially_destructible<key_type>::value;
+
+    if (impl_.root_ != nullptr && !(arena && trivial)) {
+      std::vector<node_base<value_type> *> stack;
+      stack.push_back(impl_.root_);
+      child_slot<value_type> slots[256];
+      while (!stack.empty()) {
+        node_base<value_type> *node = stack.back();
+        stack.pop_back();
+        int slot_size = node->get_all_children(slots);
+        for (int i = 0; i < slot_size; ++i) {
+          stack.push_back(*slots[i].node);
+        }
+        if (arena) {
+          node->clear_node_storage();
+        } else {
+          retire_node(node);
+        }
+      }
+    }
+
+    impl_.root_ = nullptr;
+    impl_.size_ = 0;
+    impl_.dummy_.prev_ = &impl_.dummy_;
+    impl_.dummy_.next_ = &impl_.dummy_;
+    if constexpr (Options::snapshots) {
+      collect_retired();
+      if (!impl_.retired_.empty()) {
+        return;
+      }
+    }
+    impl_.node_counter_ = 0;
+    impl_.node_type_counter_ = {};
+    if (owned) {
+      release_node_allocators();
+    }
+  }
+
+  // Writes the image read by frozen_art. Nodes are visited in key order, so
+  // each element takes the next entry and the elements under a node are the
+  // entries [first, first + count). The subfix of a node is found in the key
+  // of its first element, at the depth of the node.
+  void freeze(std::vector<char> &image) const {
+    static_assert(std::is_trivially_copyable<mapped_type>::value,
+                  "frozen values are copied as bytes");
+    static_assert(alignof(mapped_type) <= alignof(uint64_t),
+                  "frozen values are aligned to 8 bytes");
+    static_assert(levellist<value_type>::template find<node256<value_type>>() ==
+                      art_frozen_node::node256_type,
+                  "frozen node types follow levellist");
+    constexpr std::size_t stride =
+        sizeof(art_frozen_entry) + (sizeof(mapped_type) + 7) / 8 * 8;
+    auto pad = [](std::size_t n) { return (n + 7) / 8 * 8; };
+
+    struct freeze_item {
+      node_base<value_type> *node; // nullptr when the record is done
+      std::size_t slot;  // where the parent keeps the offset of this node
+      std::size_t depth; // key length above the subfix
+      std::size_t record;
+    };
+    std::vector<char> nodes, entries, keys;
+    std::vector<freeze_item> stack;
+    if (impl_.root_ != nullptr) {
+      stack.push_back({impl_.root_, 0, 0, 0});
+    }
+    child_slot<value_type> slots[256];
+    uint64_t n = 0;
+    while (!stack.empty()) {
+      const freeze_item item = stack.back();
+      stack.pop_back();
+      if (item.node == nullptr) {
+        art_frozen_node *record =
+            reinterpret_cast<art_frozen_node *>(&nodes[item.record]);
+        const art_frozen_entry *entry = reinterpret_cast<art_frozen_entry *>(
+            &entries[record->first * stride]);
+        record->count = n - record->first;
+        record->subfix = entry->key + item.depth;
+        continue;
+      }
+
+      node_base<value_type> *node = item.node;
+      const std::size_t offset = nodes.size();
+      if (offset != 0) {
+        const uint64_t o = offset;
+        std::memcpy(&nodes[item.slot], &o, sizeof(o));
+      }
+      const int slot_size = node->get_all_children(slots);
+      // positions in the record, the child offsets come last
+      std::size_t index = 0, bitmap = 0;
+      std::size_t children = sizeof(art_frozen_node);
+      switch (node->type_) {
+      case art_frozen_node::node4_type:
+      case art_frozen_node::node16_type:
+        children += pad(slot_size);
+        break;
+      case art_frozen_node::node48_type:
+        index = children;
+        bitmap = index + 256;
+        children = bitmap + sizeof(node_child_bitmap);
+        break;
+      case art_frozen_node::node256_type:
+        bitmap = children;
+        children += sizeof(node_child_bitmap);
+        break;
+      }
+      const std::size_t record_size =
+          children + sizeof(uint64_t) *
+                         (node->type_ == art_frozen_node::node256_type
+                              ? 256
+                              : slot_size);
+      nodes.resize(offset + record_size);
+
+      char *p = &nodes[offset];
+      art_frozen_node *record = reinterpret_cast<art_frozen_node *>(p);
+      record->first = n;
+      record->subfix_size = node->subfix_size_;
+      record->children_size = slot_size;
+      record->type = node->type_;
+      record->has_value = node->storage_valid_;
+      for (int i = 0; i < slot_size; ++i) {
+        const char_type c = slots[i].c;
+        if (node->type_ == art_frozen_node::node48_type) {
+          p[index + node_child_bitmap::bit(c)] = static_cast<char>(i + 1);
+        }
+        if (bitmap != 0) {
+          reinterpret_cast<node_child_bitmap *>(p + bitmap)->set(c);
+        } else {
+          p[sizeof(art_frozen_node) + i] = c;
+        }
+      }
+
+      if (node->storage_valid_) {
+        const auto key = key_traits::encode(node->get_value().first);
+        const art_frozen_entry entry = {keys.size(), key.size()};
+        keys.insert(keys.end(), key.data(), key.data() + key.size());
+        entries.resize(entries.size() + stride);
+        char *e = &entries[n * stride];
+        std::memcpy(e, &entry, sizeof(entry));
+        std::memcpy(e + sizeof(entry), &node->get_value().second,
+                    sizeof(mapped_type));
+        ++n;
+      }
+
+      stack.push_back({nullptr, 0, item.depth, offset});
+      const std::size_t depth = item.depth + node->subfix_size_ + 1;
+      for (int i = slot_size - 1; i >= 0; --i) {
+        const std::size_t position =
+            node->type_ == art_frozen_node::node256_type
+                ? node_child_bitmap::bit(slots[i].c)
+                : i;
+        stack.push_back({*slots[i].node,
+                         offset + children + sizeof(uint64_t) * position,
+                         depth, 0});
+      }
+    }
+
+    art_frozen_header header;
+    std::memcpy(header.magic, art_frozen_header::image_magic,
+                sizeof(header.magic));
+    header.byte_order = art_frozen_header::image_byte_order;
+    header.value_size = sizeof(mapped_type);
+    header.size = n;
+    header.nodes = sizeof(header);
+    header.entries = header.nodes + nodes.size();
+    header.keys = header.entries + entries.size();
+    header.image_size = header.keys + keys.size();
+
+    image.resize(header.image_size);
+    std::memcpy(image.data(), &header, sizeof(header));
+    std::copy(nodes.begin(), nodes.end(), image.begin() + header.nodes);
+    std::copy(entries.begin(), entries.end(), image.begin() + header.entries);
+    std::copy(keys.begin(), keys.end(), image.begin() + header.keys);
+  }
+
+  // One pass over the nodes in pre-order. The walk climbs back through
+  // parent_ to the next sibling instead of keeping a stack, so nothing is
+  // allocated.
+  art_stats stats() const {
+    static_assert(levellist<value_type>::template find<
+                      node_type_guard<value_type, Options>>() ==
+                      art_stats::node_types,
+                  "art_stats node types");
+    art_stats s{};
+    node_base<value_type> *node = impl_.root_;
+    std::size_t depth = 0;
+    while (node != nullptr) {
+      ++s.nodes[node->type_];
+      s.node_bytes[node->type_] += node->node_size();
+      ++s.fanout[node->children_size_];
+      ++s.subfix_sizes[art_stats::subfix_bucket(node->subfix_size_)];
+      if (node->storage_valid_) {
+        const value_type &value = node->get_value();
+        ++s.data_nodes;
+        s.depth_sum += depth;
+        s.max_depth = std::max(s.max_depth, depth);
+        s.key_heap_bytes += art_heap_bytes<key_type>::of(value.first);
+        s.value_heap_bytes +=
+            art_heap_bytes<typename value_type::second_type>::of(value.second);
+        if (node->value_boxed()) {
+          s.value_box_bytes += sizeof(value_type);
+        }
+      }
+
+      if (!node->children_empty()) {
+        ++s.inner_nodes;
+        node = *node->find_min_child().node;
+        ++depth;
+        continue;
+      }
+      // up to the first ancestor with a greater child
+      for (; node != impl_.root_; node = node->parent_, --depth) {
+        const child_slot<value_type> slot =
+            node->parent_->find_greater_child(node->parent_c_);
+        if (slot.node != nullptr) {
+          node = *slot.node;
+          break;
+        }
+      }
+      if (node == impl_.root_) {
+        node = nullptr;
+      }
+    }
+    return s;
+  }
+
+  // Calls f on the values under node in key order until it returns false,
+  // returns the number of calls. Only reads down from node, so it also walks
+  // a snapshot.
+  template <typename F>
+  static std::size_t scan_subtree(node_base<value_type> *node, F &f) {
+    std::vector<node_base<value_type> *> stack;
+    if (node != nullptr) {
+      stack.push_back(node);
+    }
+    child_slot<value_type> slots[256];
+    std::size_t n = 0;
+    while (!stack.empty()) {
+      node = stack.back();
+      stack.pop_back();
+      if (node->storage_valid_) {
+        ++n;
+        if (!f(const_cast<const value_type &>(node->get_value()))) {
+          break;
+        }
+      }
+      // push in reverse, the smallest child is visited first
+      int slot_size = node->get_all_children(slots);
+      for (int i = slot_size - 1; i >= 0; --i) {
+        stack.push_back(*slots[i].node);
+      }
+    }
+    return n;
+  }
+
+  // Deep copy of other into this empty tree, node by node with the same node
+  // types and subfix. Nodes are visited in key order, so data nodes are
+  // appended to the linked list as they are made.
+  void clone(const art_tree &other) {
+    struct clone_item {
+      node_base<value_type> *src;
+      node_base<value_type> *parent;
+      char_type c;
+    };
+
+    if (other.impl_.root_ == nullptr) {
+      return;
+    }
+
+    std::vector<clone_item> stack;
+    stack.push_back({other.impl_.root_, nullptr, 0});
+    child_slot<value_type> slots[256];
+    while (!stack.empty()) {
+      const clone_item item = stack.back();
+      stack.pop_back();
+
+      node_base<value_type> *node =
+          node_visit(item.src, [this](auto *n) -> node_base<value_type> * {
+            return node_new<typename std::remove_pointer<decltype(n)>::type>();
+          });
+      if (item.src->storage_valid_) {
+        node_emplace_value(node, item.src->get_value());
+        if constexpr (Options::linked) {
+          insert_node_link(node, impl_.dummy_.prev_, lower);
+        }
+      }
+      node->set_node_subfix(item.src->subfix_head(), item.src->subfix_size_);
+      node->set_subtree_count(item.src->subtree_count());
+
+      if (item.parent == nullptr) {
+        impl_.root_ = node;
+      } else {
+        item.parent->try_insert_child(item.c, node);
+      }
+
+      // push in reverse, the smallest child is cloned first
+      int slot_size = item.src->get_all_children(slots);
+      for (int i = slot_size - 1; i >= 0; --i) {
+        stack.push_back({*slots[i].node, node, slots[i].c});
+      }
+    }
+    impl_.size_ = other.impl_.size_;
+  }
+
+  // Builds an empty tree bottom-up from values appended in ascending key
+  // order. The nodes on the rightmost path stay open on a stack until a key
+  // branches off above them, so every inner node is made once with its final
+  // type and children. Memory is bounded by the key length, not the input.
+  struct bulk_loader {
+    struct open_node {
+      std::size_t depth;           // key length up to the end of this node
+      node_base<value_type> *data; // node0 holding the value, or nullptr
+      std::size_t children_begin;  // first child in children_
+    };
+
+    explicit bulk_loader(art_tree &tree) : tree_(tree), prev_key_() {
+      if (tree.impl_.root_ != nullptr) {
+        throw "bulk load non-empty tree";
+      }
+    }
+
+    // returns false and leaves value alone if its key is less than the last
+    // one, equal keys are dropped like insert does.
+    template <typename P> bool append(P &&value) {
+      const auto encoded_key = key_traits::encode(value.first);
+      const char_type *key = encoded_key.data();
+      const std::size_t key_size = encoded_key.size();
+      const char_type *prev_key = prev_key_.data();
+      const std::size_t prev_size = prev_key_.size();
+
+      if (!stack_.empty()) {
+        const std::size_t n = std::min(key_size, prev_size);
+        std::size_t l = 0;
+        while (l < n && key[l] == prev_key[l]) {
+          ++l;
+        }
+        if (l == key_size) {
+          return l == prev_size;
+        }
+        if (l < prev_size && key[l] < prev_key[l]) {
+          return false;
+        }
+        close(l);
+      }
+
+      node_base<value_type> *node =
+          tree_.template node_new<node0<value_type>>();
+      tree_.node_emplace_value(node, std::forward<P>(value));
+      stack_.push_back({key_size, node, children_.size()});
+      // the node is not moved until its open_node gets a child, and by then
+      // it is no longer the last key
+      prev_key_ = key_traits::encode(node->get_value().first);
+      ++tree_.impl_.size_;
+      return true;
+    }
+
+    void finish() {
+      while (!stack_.empty()) {
+        const open_node top = stack_.back();
+        stack_.pop_back();
+        node_base<value_type> *node = make_node(top);
+        if (stack_.empty()) {
+          node->set_node_subfix(prev_key_.data(), top.depth);
+          tree_.impl_.root_ = node;
+        } else {
+          attach(node, top.depth, stack_.back().depth);
+        }
+      }
+    }
+
+    // make all open nodes below depth l, the next key branches at l
+    void close(std::size_t l) {
+      while (stack_.back().depth > l) {
+        const open_node top = stack_.back();
+        stack_.pop_back();
+        node_base<value_type> *node = make_node(top);
+        if (stack_.empty() || stack_.back().depth < l) {
+          stack_.push_back({l, nullptr, children_.size()});
+        }
+        attach(node, top.depth, stack_.back().depth);
+      }
+    }
+
+    void attach(node_base<value_type> *node, std::size_t depth,
+                std::size_t parent_depth) {
+      node->set_node_subfix(prev_key_.data() + parent_depth + 1,
+                            depth - parent_depth - 1);
+      children_.push_back({prev_key_.data()[parent_depth], node});
+    }
+
+    node_base<value_type> *make_node(const open_node &top) {
+      const std::size_t n = children_.size() - top.children_begin;
+      node_base<value_type> *node;
+      if (n == 0) {
+        node = top.data;
+        if constexpr (Options::linked) {
+          tree_.insert_node_link(node, tree_.impl_.dummy_.prev_, lower);
+        }
+        node->set_subtree_count(1);
+        return node;
+      }
+
+      if (n <= node4<value_type>::max_children_size) {
+        node = tree_.template node_new<node4<value_type>>();
+      } else if (n <= node16<value_type>::max_children_size) {
+        node = tree_.template node_new<node16<value_type>>();
+      } else if (n <= node48<value_type>::max_children_size) {
+        node = tree_.template node_new<node48<value_type>>();
+      } else {
+        node = tree_.template node_new<node256<value_type>>();
+      }
+      std::size_t count = top.data != nullptr ? 1 : 0;
+      for (std::size_t i = top.children_begin; i < children_.size(); ++i) {
+        node->try_insert_child(children_[i].first, children_[i].second);
+        count += children_[i].second->subtree_count();
+      }
+      node->set_subtree_count(count);
+      children_.resize(top.children_begin);
+
+      if (top.data != nullptr) {
+        // the value comes right before its children in the list
+        tree_.node_move_value(top.data, node);
+        tree_.node_delete(top.data);
+        if constexpr (Options::linked) {
+          tree_.insert_node_link(
+              node, (*node->find_min_child().node)->find_min_data_node(),
+              upper);
+        }
+      }
+      return node;
+    }
+
+    art_tree &tree_;
+    std::vector<open_node> stack_;
+    std::vector<std::pair<char_type, node_base<value_type> *>> children_;
+    // the last key, a view of the key in its node for string keys
+    decltype(key_traits::encode(std::declval<const key_type &>())) prev_key_;
+  };
+
+  // give back whole arenas of allocators that support it, after all nodes
+  // are freed
+  template <typename node_type> void release_node_allocator(std::true_type) {
+    static_cast<node_alloca_traits_rebind<node_type> &>(impl_).release();
+  }
+  template <typename node_type> void release_node_allocator(std::false_type) {}
+  template <typename... node_type>
+  void release_node_allocators(typelist<node_type...>) {
+    (void)std::initializer_list<int>{
+        (release_node_allocator<node_type>(
+             allocator_has_release<node_alloca_traits_rebind<node_type>>()),
+         0)...};
+  }
+  void release_node_allocators() {
+    release_node_allocators(allocator_list());
+  }
+
+  // nodes go with the allocator that made them
+  template <typename... node_type>
+  void swap_node_allocators(art_tree &other, typelist<node_type...>) {
+    using std::swap;
+    (void)std::initializer_list<int>{
+        (swap(static_cast<node_alloca_traits_rebind<node_type> &>(impl_),
+              static_cast<node_alloca_traits_rebind<node_type> &>(other.impl_)),
+         0)...};
+  }
+
   void swap(art_tree &other) {
+    if constexpr (Options::snapshots) {
+      // snapshots and retired nodes go with the nodes they were taken from
+      std::swap(impl_.shared_, other.impl_.shared_);
+      std::swap(impl_.retired_, other.impl_.retired_);
+      std::swap(impl_.generation_, other.impl_.generation_);
+      std::swap(impl_.collect_at_, other.impl_.collect_at_);
+    }
+    swap_node_allocators(other, allocator_list());
     std::swap(impl_.size_, other.impl_.size_);
     std::swap(impl_.root_, other.impl_.root_);
     std::swap(impl_.node_counter_, other.impl_.node_counter_);
+    std::swap(impl_.node_type_counter_, other.impl_.node_type_counter_);
 
     node_link_base *tmp_node;
 
@@ -880,14 +2968,17 @@ template <typename K, typename V, typename Alloc> struct art_tree {
   }
 
   allocator_type get_allocator() const {
-    return impl_.node_allocator_traits::template node_alloca_helper<
-        node_type_guard<value_type>>;
+    return allocator_type(
+        static_cast<const node_alloca_traits_rebind<node4<value_type>> &>(
+            impl_));
   }
 
-  struct art_tree_impl : public node_allocator_traits {
+  struct art_tree_impl
+      : public node_allocator_traits,
+        public art_snapshot_state<node_base<value_type>, Options::snapshots> {
     art_tree_impl(const allocator_type &alloc = allocator_type())
-        : root_(nullptr), size_(0), node_counter_(0),
-          node_allocator_traits(alloc) {
+        : node_allocator_traits(alloc), size_(0), root_(nullptr),
+          node_counter_(0), node_type_counter_() {
       dummy_.prev_ = &dummy_;
       dummy_.next_ = &dummy_;
     }
@@ -899,20 +2990,31 @@ template <typename K, typename V, typename Alloc> struct art_tree {
     node_link_base dummy_;
 
     std::size_t node_counter_;
+    // nodes of each type in levellist, kept as they are made and freed
+    std::array<std::size_t, art_stats::node_types> node_type_counter_;
   };
 
   art_tree_impl impl_;
 };
 
 template <typename K, typename T,
-          typename Alloc = std::allocator<std::pair<const K, T>>>
+          typename Alloc = art_slab_allocator<std::pair<const K, T>>,
+          typename Options = art_options<>>
 struct art {
   using key_type = K;
   using mapped_type = T;
   using value_type = std::pair<const key_type, mapped_type>;
   using allocator_type = Alloc;
-
-  struct iterator {
+  template <typename V> using node_base = ::node_base<V, Options>;
+  using key_traits = art_key_traits<key_type>;
+  // lookups take a view so that string_view and (ptr, len) slices of foreign
+  // buffers are probed without building a key_type, integer keys by value.
+  // The (ptr, len) overloads take the encoded bytes of other key types.
+  using key_view = typename key_traits::view_type;
+  using tree_type = art_tree<key_type, value_type, allocator_type, Options>;
+  using link_type = typename tree_type::link_type;
+
+  struct iterator : public art_iterator_tree<tree_type, Options::linked> {
     value_type &operator*() {
       return static_cast<node_base<value_type> *>(l_)->get_value();
     }
@@ -920,32 +3022,35 @@ struct art {
       return &static_cast<node_base<value_type> *>(l_)->get_value();
     }
     iterator &operator++() {
-      l_ = l_->next_;
+      l_ = tree_type::next_link(l_);
       return *this;
     }
     iterator operator++(int) {
-      iterator tmp;
-      l_ = l_->next_;
+      iterator tmp = *this;
+      l_ = tree_type::next_link(l_);
       return tmp;
     }
     iterator &operator--() {
-      l_ = l_->prev_;
+      l_ = tree_type::prev_link(this->tree(), l_);
       return *this;
     }
     iterator operator--(int) {
-      iterator tmp;
-      l_ = l_->prev_;
+      iterator tmp = *this;
+      l_ = tree_type::prev_link(this->tree(), l_);
       return tmp;
     }
     bool operator==(const iterator &other) const { return l_ == other.l_; }
     bool operator!=(const iterator &other) const { return l_ != other.l_; }
 
-    node_link_base *l_;
+    link_type *l_;
   };
 
-  struct const_iterator {
+  struct const_iterator
+      : public art_iterator_tree<tree_type, Options::linked> {
     const_iterator() = default;
-    const_iterator(const iterator iter) : l_(iter.l_) {}
+    const_iterator(const iterator iter) : l_(iter.l_) {
+      this->set_tree(iter.tree());
+    }
 
     const value_type &operator*() {
       return static_cast<const node_base<value_type> *>(l_)->get_value();
@@ -955,21 +3060,21 @@ struct art {
     }
 
     const_iterator &operator++() {
-      l_ = l_->next_;
+      l_ = tree_type::next_link(l_);
       return *this;
     }
     const_iterator operator++(int) {
-      const_iterator tmp;
-      l_ = l_->next_;
+      const_iterator tmp = *this;
+      l_ = tree_type::next_link(l_);
       return tmp;
     }
     const_iterator &operator--() {
-      l_ = l_->prev_;
+      l_ = tree_type::prev_link(this->tree(), l_);
       return *this;
     }
     const_iterator operator--(int) {
-      const_iterator tmp;
-      l_ = l_->prev_;
+      const_iterator tmp = *this;
+      l_ = tree_type::prev_link(this->tree(), l_);
       return tmp;
     }
     bool operator==(const const_iterator &other) const {
@@ -979,13 +3084,13 @@ struct art {
       return l_ != other.l_;
     }
 
-    const node_link_base *l_;
+    const link_type *l_;
   };
 
   art(const allocator_type &alloc = allocator_type()) : t_(alloc) {}
   art(const art &other, const allocator_type &alloc = allocator_type())
       : t_(alloc) {
-    insert(other.begin(), other.end());
+    t_.clone(other.t_);
   }
   art(art &&other, const allocator_type &alloc = allocator_type()) : t_(alloc) {
     swap(other);
@@ -1003,8 +3108,10 @@ struct art {
   }
   ~art() { clear(); }
   art &operator=(const art &other) {
-    clear();
-    insert(other.begin(), other.end());
+    if (this != &other) {
+      clear();
+      t_.clone(other.t_);
+    }
     return *this;
   }
   art &operator=(art &&other) {
@@ -1019,69 +3126,110 @@ struct art {
 
   bool empty() const { return t_.impl_.size_ == 0; }
   std::size_t size() const { return t_.impl_.size_; }
-
-  iterator begin() {
-    iterator iter;
-    iter.l_ = t_.impl_.dummy_.next_;
-    return iter;
+  // memory and shape of the tree, in one pass over the nodes
+  art_stats stats() const { return t_.stats(); }
+  // nodes of each type in levellist, kept as nodes are made and freed. With
+  // snapshots they include the retired nodes not freed yet.
+  const std::array<std::size_t, art_stats::node_types> &node_counts() const {
+    return t_.impl_.node_type_counter_;
   }
-  iterator end() {
+
+  iterator begin() { return make_iterator(t_.first_link()); }
+  iterator end() { return make_iterator(t_.end_link()); }
+  const_iterator begin() const { return make_iterator(t_.first_link()); }
+  const_iterator end() const { return make_iterator(t_.end_link()); }
+  iterator make_iterator(const link_type *l) {
     iterator iter;
-    iter.l_ = &t_.impl_.dummy_;
-    return iter;
-  }
-  const_iterator begin() const {
-    const_iterator iter;
-    iter.l_ = t_.impl_.dummy_.next_;
+    iter.l_ = const_cast<link_type *>(l);
+    iter.set_tree(&t_);
     return iter;
   }
-  const_iterator end() const {
+  const_iterator make_iterator(const link_type *l) const {
     const_iterator iter;
-    iter.l_ = static_cast<const node_link_base *>(&t_.impl_.dummy_);
+    iter.l_ = l;
+    iter.set_tree(&t_);
     return iter;
   }
 
-  mapped_type &at(const key_type &key) {
-    iterator iter = find(key);
-    if (iter != end()) {
-      return iter->second;
+  mapped_type &at(key_view key) {
+    const auto k = key_traits::encode(key);
+    return at(k.data(), k.size());
+  }
+  const mapped_type &at(key_view key) const {
+    const auto k = key_traits::encode(key);
+    return at(k.data(), k.size());
+  }
+  mapped_type &at(const char_type *key, std::size_t key_size) {
+    auto r = t_.find(key, key_size);
+    if (r.second) {
+      // the value is written, snapshots keep their own
+      return t_.own_path(r.first)->get_value().second;
     }
     throw "out of range";
   }
-  const mapped_type &at(const key_type &key) const {
-    const_iterator iter = find(key);
+  const mapped_type &at(const char_type *key, std::size_t key_size) const {
+    const_iterator iter = find(key, key_size);
     if (iter != end()) {
       return iter->second;
     }
     throw "out of range";
   }
   mapped_type &operator[](const key_type &key) {
-    auto r = insert(value_type(key, mapped_type()));
-    return r.first->second;
+    auto r = try_emplace(key);
+    return (r.second ? r.first : own_value(r.first))->second;
   }
-
-  void clear() {
-    iterator iter = begin();
-    while (iter != end()) {
-      iterator tmp = iter;
-      ++iter;
-      erase(tmp);
-    }
-
-    if (t_.impl_.node_counter_ != 0) {
-      throw "bad clear";
-    }
+  mapped_type &operator[](key_type &&key) {
+    auto r = try_emplace(std::move(key));
+    return (r.second ? r.first : own_value(r.first))->second;
+  }
+  // the value at it is written, snapshots keep their own
+  iterator own_value(iterator it) {
+    return make_iterator(
+        t_.own_path(static_cast<node_base<value_type> *>(it.l_)));
   }
+
+  void clear() { t_.clear(); }
   std::pair<iterator, bool> insert(const value_type &value) {
-    auto r = t_.insert(value);
-    iterator iter;
-    iter.l_ = r.first;
-    return {iter, r.second};
+    return emplace_key(value.first, value);
+  }
+  std::pair<iterator, bool> insert(value_type &&value) {
+    return emplace_key(value.first, std::move(value));
+  }
+  template <typename P,
+            typename = typename std::enable_if<
+                std::is_constructible<value_type, P &&>::value>::type>
+  std::pair<iterator, bool> insert(P &&value) {
+    return insert_pair(
+        std::forward<P>(value),
+        std::is_same<typename std::decay<decltype(value.first)>::type,
+                     key_type>());
   }
-  // template <typename P> std::pair<iterator, bool> insert(P &&value) {
-  //   throw("not implement");
-  // }
   template <typename InputIt> void insert(InputIt first, InputIt last) {
+    if (empty()) {
+      bulk_load(first, last);
+      return;
+    }
+    for (; first != last; ++first) {
+      insert(*first);
+    }
+  }
+  // Build an empty tree bottom-up from a range sorted in key order (char_type
+  // order). From the first key that is out of order on, or if the tree is not
+  // empty, values are inserted one by one.
+  template <typename InputIt> void bulk_load(InputIt first, InputIt last) {
+    if (!empty()) {
+      insert(first, last);
+      return;
+    }
+
+    typename tree_type::bulk_loader loader(t_);
+    for (; first != last; ++first) {
+      if (!loader.append(*first)) {
+        break;
+      }
+    }
+    loader.finish();
+
     for (; first != last; ++first) {
       insert(*first);
     }
@@ -1089,22 +3237,64 @@ struct art {
   void insert(std::initializer_list<value_type> ilist) {
     insert(ilist.begin(), ilist.end());
   }
-  // template <typename... Args>
-  // std::pair<iterator, bool> emplace(Args &&...args) {
-  //   throw("not implement");
-  // }
-  iterator erase(iterator pos) {
-    iterator next = pos;
-    ++next;
-    t_.erase(static_cast<node_base<value_type> *>(pos.l_));
-    return next;
+  // key and mapped value given apart are constructed in place, other
+  // arguments go through a value_type temporary.
+  template <typename Key, typename M,
+            typename = typename std::enable_if<std::is_same<
+                typename std::decay<Key>::type, key_type>::value>::type>
+  std::pair<iterator, bool> emplace(Key &&key, M &&obj) {
+    return emplace_key(key, std::forward<Key>(key), std::forward<M>(obj));
+  }
+  template <typename... Args>
+  std::pair<iterator, bool> emplace(Args &&...args) {
+    value_type value(std::forward<Args>(args)...);
+    return emplace_key(value.first, std::move(value));
+  }
+  // nothing is constructed when key exists
+  template <typename... Args>
+  std::pair<iterator, bool> try_emplace(const key_type &key, Args &&...args) {
+    return emplace_key(key, std::piecewise_construct,
+                       std::forward_as_tuple(key),
+                       std::forward_as_tuple(std::forward<Args>(args)...));
+  }
+  template <typename... Args>
+  std::pair<iterator, bool> try_emplace(key_type &&key, Args &&...args) {
+    return emplace_key(key, std::piecewise_construct,
+                       std::forward_as_tuple(std::move(key)),
+                       std::forward_as_tuple(std::forward<Args>(args)...));
+  }
+  template <typename M>
+  std::pair<iterator, bool> insert_or_assign(const key_type &key, M &&obj) {
+    auto r = try_emplace(key, std::forward<M>(obj));
+    if (!r.second) {
+      r.first = own_value(r.first);
+      r.first->second = std::forward<M>(obj);
+    }
+    return r;
   }
+  template <typename M>
+  std::pair<iterator, bool> insert_or_assign(key_type &&key, M &&obj) {
+    auto r = try_emplace(std::move(key), std::forward<M>(obj));
+    if (!r.second) {
+      r.first = own_value(r.first);
+      r.first->second = std::forward<M>(obj);
+    }
+    return r;
+  }
+  iterator erase(iterator pos) { return erase(const_iterator(pos)); }
   iterator erase(const_iterator pos) {
-    iterator next;
-    next.l_ = const_cast<node_link_base *>(pos.l_);
+    node_base<value_type> *node = static_cast<node_base<value_type> *>(
+        const_cast<link_type *>(pos.l_));
+    if constexpr (Options::snapshots) {
+      // the next node may be copied by the erase, look it up after
+      const auto k = key_traits::encode(node->get_value().first);
+      const std::basic_string<char_type> key(k.data(), k.size());
+      t_.erase(node);
+      return lower_bound(key.data(), key.size());
+    }
+    iterator next = make_iterator(pos.l_);
     ++next;
-    t_.erase(static_cast<node_base<value_type> *>(
-        const_cast<node_link_base *>(pos.l_)));
+    t_.erase(node);
     return next;
   }
   iterator erase(iterator first, iterator last) {
@@ -1114,517 +3304,2575 @@ struct art {
     return last;
   }
   iterator erase(const_iterator first, const_iterator last) {
-    iterator iter;
     while (first != last) {
       first = erase(first);
     }
-    iter.l_ = const_cast<node_link_base *>(last.l_);
-    return iter;
+    return make_iterator(last.l_);
+  }
+  std::size_t erase(key_view key) {
+    const auto k = key_traits::encode(key);
+    return erase(k.data(), k.size());
+  }
+  std::size_t erase(const char_type *key, std::size_t key_size) {
+    auto r = t_.find(key, key_size);
+    if (r.second) {
+      t_.erase(r.first);
+      return 1;
+    }
+    return 0;
+  }
+  void swap(art &other) { t_.swap(other.t_); }
+
+  template <typename P>
+  std::pair<iterator, bool> insert_pair(P &&value, std::true_type) {
+    return emplace_key(value.first, std::forward<P>(value));
+  }
+  template <typename P>
+  std::pair<iterator, bool> insert_pair(P &&value, std::false_type) {
+    return emplace(std::forward<P>(value));
+  }
+
+  // key is only read before args are used
+  template <typename Key, typename... Args>
+  std::pair<iterator, bool> emplace_key(const Key &key, Args &&...args) {
+    const auto k = key_traits::encode(key);
+    auto r = t_.emplace(k.data(), k.size(), std::forward<Args>(args)...);
+    return {make_iterator(r.first), r.second};
+  }
+
+  std::size_t count(key_view key) const {
+    const auto k = key_traits::encode(key);
+    return count(k.data(), k.size());
+  }
+  std::size_t count(const char_type *key, std::size_t key_size) const {
+    const_iterator iter = find(key, key_size);
+    if (iter != end()) {
+      return 1;
+    }
+    return 0;
+  }
+  iterator find(key_view key) {
+    const auto k = key_traits::encode(key);
+    return find(k.data(), k.size());
+  }
+  const_iterator find(key_view key) const {
+    const auto k = key_traits::encode(key);
+    return find(k.data(), k.size());
+  }
+  iterator find(const char_type *key, std::size_t key_size) {
+    art::const_iterator citer =
+        const_cast<const art &>(*this).find(key, key_size);
+    return make_iterator(citer.l_);
+  }
+  const_iterator find(const char_type *key, std::size_t key_size) const {
+    auto r = t_.find(key, key_size);
+    if (r.second) {
+      return make_iterator(r.first);
+    }
+    return end();
+  }
+  // Looks up keys[0, n) together, results[i] is end() if keys[i] is not
+  // found. Key is anything that converts to key_view, such as key_type.
+  template <typename Key>
+  void multi_find(const Key *keys, std::size_t n, iterator *results) {
+    t_.multi_find(keys, n, [&](std::size_t i, node_base<value_type> *node) {
+      results[i] = node != nullptr ? make_iterator(node) : end();
+    });
+  }
+  template <typename Key>
+  void multi_find(const Key *keys, std::size_t n,
+                  const_iterator *results) const {
+    t_.multi_find(keys, n, [&](std::size_t i, node_base<value_type> *node) {
+      results[i] = node != nullptr ? make_iterator(node) : end();
+    });
+  }
+  std::pair<iterator, iterator> equal_range(key_view key) {
+    const auto k = key_traits::encode(key);
+    return equal_range(k.data(), k.size());
+  }
+  std::pair<const_iterator, const_iterator>
+  equal_range(key_view key) const {
+    const auto k = key_traits::encode(key);
+    return equal_range(k.data(), k.size());
+  }
+  std::pair<iterator, iterator> equal_range(const char_type *key,
+                                            std::size_t key_size) {
+    auto r = const_cast<const art &>(*this).equal_range(key, key_size);
+    return {make_iterator(r.first.l_), make_iterator(r.second.l_)};
+  }
+  std::pair<const_iterator, const_iterator>
+  equal_range(const char_type *key, std::size_t key_size) const {
+    const_iterator iter = find(key, key_size);
+    if (iter != end()) {
+      const_iterator tmp = iter;
+      ++iter;
+      return {tmp, iter};
+    }
+    return {end(), end()};
+  }
+  iterator lower_bound(key_view key) {
+    const auto k = key_traits::encode(key);
+    return lower_bound(k.data(), k.size());
+  }
+  const_iterator lower_bound(key_view key) const {
+    const auto k = key_traits::encode(key);
+    return lower_bound(k.data(), k.size());
+  }
+  iterator lower_bound(const char_type *key, std::size_t key_size) {
+    const_iterator citer =
+        const_cast<const art &>(*this).lower_bound(key, key_size);
+    return make_iterator(citer.l_);
+  }
+  const_iterator lower_bound(const char_type *key,
+                             std::size_t key_size) const {
+    const link_type *node = t_.lower_bound(key, key_size).first;
+    if (node == nullptr) {
+      return end();
+    }
+    return make_iterator(node);
+  }
+  iterator upper_bound(key_view key) {
+    const auto k = key_traits::encode(key);
+    return upper_bound(k.data(), k.size());
+  }
+  const_iterator upper_bound(key_view key) const {
+    const auto k = key_traits::encode(key);
+    return upper_bound(k.data(), k.size());
+  }
+  iterator upper_bound(const char_type *key, std::size_t key_size) {
+    const_iterator citer =
+        const_cast<const art &>(*this).upper_bound(key, key_size);
+    return make_iterator(citer.l_);
+  }
+  const_iterator upper_bound(const char_type *key,
+                             std::size_t key_size) const {
+    auto r = t_.lower_bound(key, key_size);
+    const link_type *node = r.first;
+    if (node == nullptr) {
+      return end();
+    }
+
+    const_iterator iter = make_iterator(node);
+
+    if (r.second) {
+      return ++iter;
+    }
+    return iter;
+  }
+
+  // [first, last) of the elements whose key starts with prefix, taken from
+  // the subtree the prefix ends in, no key is compared
+  std::pair<iterator, iterator> prefix_range(key_view prefix) {
+    const auto k = key_traits::encode(prefix);
+    return prefix_range(k.data(), k.size());
+  }
+  std::pair<const_iterator, const_iterator>
+  prefix_range(key_view prefix) const {
+    const auto k = key_traits::encode(prefix);
+    return prefix_range(k.data(), k.size());
+  }
+  std::pair<iterator, iterator> prefix_range(const char_type *prefix,
+                                             std::size_t prefix_size) {
+    auto r = const_cast<const art &>(*this).prefix_range(prefix, prefix_size);
+    return {make_iterator(r.first.l_), make_iterator(r.second.l_)};
+  }
+  std::pair<const_iterator, const_iterator>
+  prefix_range(const char_type *prefix, std::size_t prefix_size) const {
+    auto r = t_.prefix_range(prefix, prefix_size);
+    if (r.first == nullptr) {
+      return {end(), end()};
+    }
+    return {make_iterator(r.first),
+            make_iterator(tree_type::next_link(r.second))};
+  }
+  // Calls f on every element whose key starts with prefix, in key order,
+  // until f returns false. Returns the number of calls.
+  template <typename F> std::size_t scan_prefix(key_view prefix, F &&f) {
+    return scan_range(prefix_range(prefix), f);
+  }
+  template <typename F>
+  std::size_t scan_prefix(key_view prefix, F &&f) const {
+    return scan_range(prefix_range(prefix), f);
+  }
+  template <typename F>
+  std::size_t scan_prefix(const char_type *prefix, std::size_t prefix_size,
+                          F &&f) {
+    return scan_range(prefix_range(prefix, prefix_size), f);
+  }
+  template <typename F>
+  std::size_t scan_prefix(const char_type *prefix, std::size_t prefix_size,
+                          F &&f) const {
+    return scan_range(prefix_range(prefix, prefix_size), f);
+  }
+  template <typename Iterator, typename F>
+  static std::size_t scan_range(std::pair<Iterator, Iterator> range, F &f) {
+    std::size_t n = 0;
+    for (Iterator iter = range.first; iter != range.second; ++iter) {
+      ++n;
+      if (!f(*iter)) {
+        break;
+      }
+    }
+    return n;
+  }
+
+  // Order statistics, for art_options<true> only. rank is the number of keys
+  // less than key, select(i) the element at index i in key order or end().
+  std::size_t rank(key_view key) const {
+    const auto k = key_traits::encode(key);
+    return rank(k.data(), k.size());
+  }
+  std::size_t rank(const char_type *key, std::size_t key_size) const {
+    return t_.rank(key, key_size);
+  }
+  iterator select(std::size_t i) {
+    if (i >= size()) {
+      return end();
+    }
+    return make_iterator(t_.select(i));
+  }
+  const_iterator select(std::size_t i) const {
+    if (i >= size()) {
+      return end();
+    }
+    return make_iterator(t_.select(i));
+  }
+  // number of keys in [first, last)
+  std::size_t count_range(key_view first, key_view last) const {
+    const std::size_t first_rank = rank(first);
+    const std::size_t last_rank = rank(last);
+    return last_rank > first_rank ? last_rank - first_rank : 0;
+  }
+  std::size_t count_prefix(key_view prefix) const {
+    const auto k = key_traits::encode(prefix);
+    return count_prefix(k.data(), k.size());
+  }
+  std::size_t count_prefix(const char_type *prefix,
+                           std::size_t prefix_size) const {
+    return t_.count_prefix(prefix, prefix_size);
+  }
+
+  // Read-only view of the elements as they were when snapshot() was called,
+  // for art_options<..., true>. It shares its nodes with the tree, which
+  // copies a node before changing it while a snapshot may see it, so the view
+  // holds still while the tree is written, also from another thread. The
+  // view may outlive the tree, or be moved to another tree by swap().
+  //
+  // While a snapshot is open every write to the tree may copy the nodes on
+  // its path, the ones holding values included, so every write invalidates
+  // all iterators, pointers and references into the tree. Values written in
+  // place through an iterator are seen by snapshots, at() and operator[]
+  // copy first.
+  struct snapshot_view {
+    using shared_state =
+        typename art_snapshot_state<node_base<value_type>, true>::shared_state;
+
+    snapshot_view(std::shared_ptr<shared_state> state,
+                  node_base<value_type> *root, std::size_t size,
+                  uint32_t generation)
+        : state_(std::move(state)), root_(root), size_(size),
+          generation_(generation) {}
+    snapshot_view(const snapshot_view &) = delete;
+    snapshot_view &operator=(const snapshot_view &) = delete;
+    snapshot_view(snapshot_view &&other)
+        : state_(std::move(other.state_)), root_(other.root_),
+          size_(other.size_), generation_(other.generation_) {}
+    snapshot_view &operator=(snapshot_view &&other) {
+      if (this != &other) {
+        release();
+        state_ = std::move(other.state_);
+        root_ = other.root_;
+        size_ = other.size_;
+        generation_ = other.generation_;
+      }
+      return *this;
+    }
+    ~snapshot_view() { release(); }
+
+    // the nodes only the snapshot sees are freed by the next tree change, or
+    // with the last view once the tree is gone
+    void release() {
+      if (state_ != nullptr) {
+        state_->close_snapshot(generation_);
+        state_.reset();
+      }
+    }
+
+    bool empty() const { return size_ == 0; }
+    std::size_t size() const { return size_; }
+
+    const value_type *find(key_view key) const {
+      const auto k = key_traits::encode(key);
+      return find(k.data(), k.size());
+    }
+    const value_type *find(const char_type *key, std::size_t key_size) const {
+      auto r = tree_type::find(root_, key, key_size);
+      return r.second ? &r.first->get_value() : nullptr;
+    }
+    std::size_t count(key_view key) const { return find(key) ? 1 : 0; }
+    const mapped_type &at(key_view key) const {
+      const value_type *value = find(key);
+      if (value == nullptr) {
+        throw "out of range";
+      }
+      return value->second;
+    }
+
+    // Calls f on the elements in key order, or on those whose key starts
+    // with prefix, until f returns false. Returns the number of calls.
+    template <typename F> std::size_t scan(F &&f) const {
+      return tree_type::scan_subtree(root_, f);
+    }
+    template <typename F>
+    std::size_t scan_prefix(key_view prefix, F &&f) const {
+      const auto k = key_traits::encode(prefix);
+      return scan_prefix(k.data(), k.size(), f);
+    }
+    template <typename F>
+    std::size_t scan_prefix(const char_type *prefix, std::size_t prefix_size,
+                            F &&f) const {
+      const auto r = tree_type::find_last_node(root_, prefix, prefix_size);
+      if (r.node == nullptr || r.key_cur != prefix_size) {
+        return 0;
+      }
+      return tree_type::scan_subtree(r.node, f);
+    }
+
+    std::shared_ptr<shared_state> state_;
+    node_base<value_type> *root_;
+    std::size_t size_;
+    uint32_t generation_;
+  };
+  // Opens a snapshot. Until it is released, every write invalidates all
+  // iterators into the tree, see snapshot_view.
+  snapshot_view snapshot() {
+    static_assert(Options::snapshots, "snapshot needs art_options<..., true>");
+    t_.collect_retired();
+    const uint32_t generation = t_.impl_.open_snapshot();
+    return snapshot_view(t_.impl_.shared_, t_.impl_.root_, t_.impl_.size_,
+                         generation);
+  }
+
+  // Read-only image of the tree for frozen_art, for trivially copyable
+  // mapped_type. The file is mapped by frozen_art on the same platform.
+  std::vector<char> freeze() const {
+    std::vector<char> image;
+    t_.freeze(image);
+    return image;
+  }
+  void freeze(const char *path) const {
+    const std::vector<char> image = freeze();
+    std::FILE *file = std::fopen(path, "wb");
+    if (file == nullptr) {
+      throw "write image";
+    }
+    const bool written =
+        std::fwrite(image.data(), 1, image.size(), file) == image.size();
+    if (std::fclose(file) != 0 || !written) {
+      throw "write image";
+    }
+  }
+
+  // Streams the elements in key order for load(), for a trivially copyable
+  // or string mapped_type. Memory is one block of records and the last key.
+  void save(std::ostream &out) const {
+    using value_codec = art_dump_value<mapped_type>;
+    art_dump_header header;
+    std::memcpy(header.magic, art_dump_header::dump_magic,
+                sizeof(header.magic));
+    header.byte_order = art_frozen_header::image_byte_order;
+    header.key_size = dump_key_size;
+    header.value_size = value_codec::value_size;
+    header.size = size();
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+    std::basic_string<char_type> records;
+    std::basic_string<char_type> prev_key;
+    art_dump_block block{0, 0, 0};
+    auto flush = [&]() {
+      block.bytes = static_cast<uint32_t>(records.size());
+      block.checksum = art_dump::checksum(block, records);
+      out.write(reinterpret_cast<const char *>(&block), sizeof(block));
+      out.write(records.data(), records.size());
+      records.clear();
+      prev_key.clear();
+      block.count = 0;
+    };
+    for (const value_type &value : *this) {
+      const auto encoded_key = key_traits::encode(value.first);
+      const char_type *key = encoded_key.data();
+      const std::size_t key_size = encoded_key.size();
+      const std::size_t n = std::min(key_size, prev_key.size());
+      std::size_t l = 0;
+      while (l < n && key[l] == prev_key[l]) {
+        ++l;
+      }
+      art_dump::put_varint(records, l);
+      art_dump::put_varint(records, key_size - l);
+      records.append(key + l, key_size - l);
+      value_codec::put(records, value.second);
+      prev_key.assign(key, key_size);
+      ++block.count;
+      if (records.size() >= art_dump::block_size) {
+        flush();
+      }
+    }
+    if (block.count != 0) {
+      flush();
+    }
+    flush();
+    if (!out) {
+      throw "write dump";
+    }
+  }
+  // Replaces the elements with those of a stream written by save(), built
+  // bottom-up as the blocks are read. Throws "bad dump" if the stream is
+  // corrupt, truncated or of other key or value types, and then leaves the
+  // tree empty.
+  void load(std::istream &in) {
+    clear();
+    typename tree_type::bulk_loader loader(t_);
+    try {
+      load_blocks(in, loader);
+    } catch (...) {
+      loader.finish();
+      clear();
+      throw;
+    }
+    loader.finish();
+  }
+  void load_blocks(std::istream &in, typename tree_type::bulk_loader &loader) {
+    using value_codec = art_dump_value<mapped_type>;
+    art_dump_header header;
+    if (!in.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+        std::memcmp(header.magic, art_dump_header::dump_magic,
+                    sizeof(header.magic)) != 0 ||
+        header.byte_order != art_frozen_header::image_byte_order ||
+        header.key_size != dump_key_size ||
+        header.value_size != value_codec::value_size) {
+      throw "bad dump";
+    }
+
+    std::basic_string<char_type> records;
+    std::basic_string<char_type> key;
+    for (;;) {
+      art_dump_block block;
+      if (!in.read(reinterpret_cast<char *>(&block), sizeof(block))) {
+        throw "bad dump";
+      }
+      // read in steps so a corrupt size runs into the end of the stream
+      // before it is allocated
+      records.clear();
+      while (records.size() < block.bytes) {
+        const std::size_t read = records.size();
+        records.resize(
+            read + std::min<std::size_t>(block.bytes - read,
+                                         art_dump::block_size));
+        if (!in.read(&records[read], records.size() - read)) {
+          throw "bad dump";
+        }
+      }
+      if (art_dump::checksum(block, records) != block.checksum) {
+        throw "bad dump";
+      }
+      if (block.count == 0 && records.empty()) {
+        break;
+      }
+
+      const char_type *p = records.data();
+      const char_type *end = p + records.size();
+      key.clear();
+      for (uint32_t i = 0; i < block.count; ++i) {
+        uint64_t shared;
+        uint64_t rest;
+        std::optional<mapped_type> obj;
+        if (!art_dump::get_varint(p, end, shared) || shared > key.size() ||
+            !art_dump::get_varint(p, end, rest) ||
+            rest > static_cast<uint64_t>(end - p)) {
+          throw "bad dump";
+        }
+        key.resize(shared);
+        key.append(p, rest);
+        p += rest;
+        if ((dump_key_size != 0 && key.size() != dump_key_size) ||
+            !value_codec::get(p, end, obj) ||
+            !loader.append(value_type(
+                key_traits::decode(key.data(), key.size()),
+                std::move(*obj)))) {
+          throw "bad dump";
+        }
+      }
+      if (p != end) {
+        throw "bad dump";
+      }
+    }
+    if (size() != header.size) {
+      throw "bad dump";
+    }
+  }
+  constexpr static uint64_t dump_key_size =
+      std::is_integral<key_type>::value ? sizeof(key_type) : 0;
+
+  allocator_type get_allocator() const { return t_.get_allocator(); }
+
+  tree_type t_;
+};
+
+// Read-only map over an image written by art::freeze(), used in place from
+// memory or a mapped file, without building any node. Elements are the
+// entries of the image in key order, so an iterator is an index, and each
+// node knows the entries under it, so lower_bound stops where the key leaves
+// the tree. Keys are given back as their encoded bytes, integers decoded.
+template <typename K, typename T> struct frozen_art {
+  using key_type = K;
+  using mapped_type = T;
+  using key_traits = art_key_traits<key_type>;
+  using key_view = typename key_traits::view_type;
+
+  struct const_iterator {
+    std::basic_string_view<char_type> key_bytes() const {
+      const art_frozen_entry *e = f_->entry(i_);
+      return {f_->keys_ + e->key, static_cast<std::size_t>(e->key_size)};
+    }
+    auto key() const {
+      if constexpr (std::is_integral<key_type>::value) {
+        return key_traits::decode(key_bytes().data());
+      } else {
+        return key_bytes();
+      }
+    }
+    const mapped_type &value() const {
+      return *reinterpret_cast<const mapped_type *>(f_->entry(i_) + 1);
+    }
+
+    const_iterator &operator++() {
+      ++i_;
+      return *this;
+    }
+    const_iterator operator++(int) {
+      const_iterator tmp = *this;
+      ++i_;
+      return tmp;
+    }
+    const_iterator &operator--() {
+      --i_;
+      return *this;
+    }
+    const_iterator operator--(int) {
+      const_iterator tmp = *this;
+      --i_;
+      return tmp;
+    }
+    bool operator==(const const_iterator &other) const {
+      return i_ == other.i_;
+    }
+    bool operator!=(const const_iterator &other) const {
+      return i_ != other.i_;
+    }
+
+    const frozen_art *f_;
+    uint64_t i_;
+  };
+
+  // image must stay valid and 8 byte aligned while the map is used
+  frozen_art(const void *image, std::size_t size) { open(image, size); }
+#if defined(__unix__) || defined(__APPLE__)
+  explicit frozen_art(const char *path) {
+    const int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+      throw "open image";
+    }
+    struct stat st;
+    void *image = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      image = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (image == MAP_FAILED) {
+      throw "map image";
+    }
+    mapped_ = image;
+    mapped_size_ = st.st_size;
+    try {
+      open(image, mapped_size_);
+    } catch (...) {
+      munmap(mapped_, mapped_size_);
+      throw;
+    }
+  }
+#endif
+  frozen_art(const frozen_art &) = delete;
+  frozen_art &operator=(const frozen_art &) = delete;
+  ~frozen_art() {
+#if defined(__unix__) || defined(__APPLE__)
+    if (mapped_ != nullptr) {
+      munmap(mapped_, mapped_size_);
+    }
+#endif
+  }
+
+  bool empty() const { return size_ == 0; }
+  std::size_t size() const { return size_; }
+  const_iterator begin() const { return {this, 0}; }
+  const_iterator end() const { return {this, size_}; }
+
+  const_iterator find(key_view key) const {
+    const auto k = key_traits::encode(key);
+    return find(k.data(), k.size());
+  }
+  const_iterator find(const char_type *key, std::size_t key_size) const {
+    bool found;
+    const uint64_t i = lower_bound_index(key, key_size, &found);
+    return found ? const_iterator{this, i} : end();
+  }
+  std::size_t count(key_view key) const { return find(key) != end(); }
+  const mapped_type &at(key_view key) const {
+    const_iterator iter = find(key);
+    if (iter == end()) {
+      throw "out of range";
+    }
+    return iter.value();
+  }
+  const_iterator lower_bound(key_view key) const {
+    const auto k = key_traits::encode(key);
+    return lower_bound(k.data(), k.size());
+  }
+  const_iterator lower_bound(const char_type *key,
+                             std::size_t key_size) const {
+    bool found;
+    return {this, lower_bound_index(key, key_size, &found)};
+  }
+  const_iterator upper_bound(key_view key) const {
+    const auto k = key_traits::encode(key);
+    return upper_bound(k.data(), k.size());
+  }
+  const_iterator upper_bound(const char_type *key,
+                             std::size_t key_size) const {
+    bool found;
+    const uint64_t i = lower_bound_index(key, key_size, &found);
+    return {this, found ? i + 1 : i};
+  }
+
+  void open(const void *image, std::size_t size) {
+    static_assert(std::is_trivially_copyable<mapped_type>::value,
+                  "frozen values are copied as bytes");
+    const art_frozen_header *header =
+        static_cast<const art_frozen_header *>(image);
+    if (size < sizeof(art_frozen_header) ||
+        std::memcmp(header->magic, art_frozen_header::image_magic,
+                    sizeof(header->magic)) != 0 ||
+        header->byte_order != art_frozen_header::image_byte_order ||
+        header->value_size != sizeof(mapped_type) ||
+        header->image_size != size || header->nodes > header->entries ||
+        header->entries > header->keys || header->keys > size ||
+        header->keys - header->entries != header->size * stride) {
+      throw "bad image";
+    }
+    const char *base = static_cast<const char *>(image);
+    nodes_ = base + header->nodes;
+    entries_ = base + header->entries;
+    keys_ = base + header->keys;
+    size_ = header->size;
+  }
+
+  const art_frozen_entry *entry(uint64_t i) const {
+    return reinterpret_cast<const art_frozen_entry *>(entries_ + i * stride);
+  }
+  const art_frozen_node *node(uint64_t offset) const {
+    return reinterpret_cast<const art_frozen_node *>(nodes_ + offset);
+  }
+  const char_type *subfix(const art_frozen_node *node) const {
+    return keys_ + node->subfix;
+  }
+  const char *children(const art_frozen_node *node) const {
+    return reinterpret_cast<const char *>(node + 1);
+  }
+  // offsets of the children of a node4 or node16, after their keys
+  const uint64_t *sorted_offsets(const art_frozen_node *node) const {
+    return reinterpret_cast<const uint64_t *>(
+        children(node) + (node->children_size + 7) / 8 * 8);
+  }
+  // node48 and node256, the node48 index comes first
+  const node_child_bitmap *bitmap(const art_frozen_node *node) const {
+    const std::size_t index =
+        node->type == art_frozen_node::node48_type ? 256 : 0;
+    return reinterpret_cast<const node_child_bitmap *>(children(node) + index);
+  }
+  const uint64_t *bitmap_offsets(const art_frozen_node *node) const {
+    return reinterpret_cast<const uint64_t *>(bitmap(node) + 1);
+  }
+  const art_frozen_node *child_at(const art_frozen_node *node,
+                                  char_type c) const {
+    const unsigned b = node_child_bitmap::bit(c);
+    if (node->type == art_frozen_node::node48_type) {
+      const uint8_t i = children(node)[b];
+      return i == 0 ? nullptr : this->node(bitmap_offsets(node)[i - 1]);
+    }
+    const uint64_t offset = bitmap_offsets(node)[b];
+    return offset == 0 ? nullptr : this->node(offset);
+  }
+  const art_frozen_node *find_child(const art_frozen_node *node,
+                                    char_type c) const {
+    switch (node->type) {
+    case art_frozen_node::node0_type:
+      return nullptr;
+    case art_frozen_node::node4_type:
+    case art_frozen_node::node16_type:
+      for (int i = 0; i < node->children_size; ++i) {
+        if (children(node)[i] == c) {
+          return this->node(sorted_offsets(node)[i]);
+        }
+      }
+      return nullptr;
+    default:
+      return child_at(node, c);
+    }
+  }
+  // the first child with a byte greater than c, or nullptr
+  const art_frozen_node *find_greater_child(const art_frozen_node *node,
+                                            char_type c) const {
+    switch (node->type) {
+    case art_frozen_node::node0_type:
+      return nullptr;
+    case art_frozen_node::node4_type:
+    case art_frozen_node::node16_type:
+      for (int i = 0; i < node->children_size; ++i) {
+        if (children(node)[i] > c) {
+          return this->node(sorted_offsets(node)[i]);
+        }
+      }
+      return nullptr;
+    default:
+      char_type greater;
+      if (c == char_type_maxium || !bitmap(node)->find_geq(c + 1, &greater)) {
+        return nullptr;
+      }
+      return child_at(node, greater);
+    }
+  }
+
+  // The entry of the first element not less than key, the same walk and
+  // cases as art_tree::lower_bound. found is set if its key is key.
+  uint64_t lower_bound_index(const char_type *key, std::size_t key_size,
+                             bool *found) const {
+    *found = false;
+    if (size_ == 0) {
+      return 0;
+    }
+
+    const art_frozen_node *node = this->node(0);
+    std::size_t cursor = 0;
+    while (true) {
+      auto r = node_base<std::pair<const key_type, mapped_type>>::
+          compare_subfix(subfix(node), node->subfix_size, key + cursor,
+                         key_size - cursor);
+      const bool whole = r.first == node->subfix_size;
+      cursor += r.first;
+      if (cursor < key_size && whole) {
+        const art_frozen_node *child = find_child(node, key[cursor]);
+        if (child != nullptr) {
+          ++cursor;
+          node = child;
+          continue;
+        }
+        // no child for the key byte, the elements under a greater child
+        // come next
+        child = find_greater_child(node, key[cursor]);
+        return child != nullptr ? child->first : node->first + node->count;
+      }
+      if (cursor == key_size) {
+        *found = whole && node->has_value;
+        return node->first;
+      }
+      // the key leaves the subfix of node
+      return subfix(node)[r.first] > key[cursor] ? node->first
+                                                  : node->first + node->count;
+    }
+  }
+
+  constexpr static std::size_t stride =
+      sizeof(art_frozen_entry) + (sizeof(mapped_type) + 7) / 8 * 8;
+
+  const char *nodes_ = nullptr;
+  const char *entries_ = nullptr;
+  const char_type *keys_ = nullptr;
+  std::size_t size_ = 0;
+  void *mapped_ = nullptr;
+  std::size_t mapped_size_ = 0;
+};
+
+// Epoch based reclamation. A thread announces the global epoch while it is in
+// a critical section, and a retired object waits in the limbo list of the
+// thread that retired it, tagged with the epoch of that time. The epoch only
+// moves on once every thread in a critical section has announced it, so an
+// object retired in epoch e can no longer be seen by anyone at epoch e + 2.
+//
+// Limbo lists are collected by the thread that owns them, or by any thread
+// that collects while the owner is gone, so the deleters run wherever
+// retire() and reclaim() are called.
+struct epoch_manager {
+  struct retired_object {
+    uint64_t epoch;
+    void *ptr;
+    void (*deleter)(void *context, void *ptr);
+    void *context;
+  };
+
+  struct thread_record {
+    thread_record()
+        : epoch(0), in_use(true), depth(0), collect_size(collect_threshold),
+          local(nullptr), next(nullptr) {}
+
+    std::atomic<uint64_t> epoch; // announced epoch, 0 outside
+    std::atomic<bool> in_use;
+    unsigned depth; // nested critical sections
+    std::vector<retired_object> limbo;
+    // collect at this limbo size, doubled over what a collect leaves so a
+    // slow reader does not make every retire scan the list
+    std::size_t collect_size;
+    // per thread state of the manager's user, taken over with the record
+    // and freed by that user
+    void *local;
+    thread_record *next;
+  };
+
+  // Records are only added, a thread gives its record back when it exits and
+  // the next thread to register takes it over with its limbo list. The state
+  // is shared with the thread caches, so the manager may go away first.
+  struct shared_state {
+    shared_state() : epoch(1), records(nullptr), closed(false) {}
+    ~shared_state() {
+      while (records != nullptr) {
+        thread_record *next = records.load()->next;
+        delete records.load();
+        records = next;
+      }
+    }
+
+    std::atomic<uint64_t> epoch;
+    std::atomic<thread_record *> records;
+    std::atomic<bool> closed;
+  };
+
+  struct guard {
+    explicit guard(epoch_manager &manager)
+        : manager_(manager), record_(manager.this_thread()) {
+      manager_.enter(record_);
+    }
+    guard(const guard &) = delete;
+    guard &operator=(const guard &) = delete;
+    ~guard() { manager_.leave(record_); }
+
+    epoch_manager &manager_;
+    thread_record *record_;
+  };
+
+  epoch_manager() : state_(std::make_shared<shared_state>()) {}
+  epoch_manager(const epoch_manager &) = delete;
+  epoch_manager &operator=(const epoch_manager &) = delete;
+  ~epoch_manager() {
+    release();
+    state_->closed = true;
+  }
+
+  thread_record *register_thread() {
+    for (thread_record *r = state_->records; r != nullptr; r = r->next) {
+      bool idle = false;
+      if (r->in_use.compare_exchange_strong(idle, true)) {
+        return r;
+      }
+    }
+
+    thread_record *record = new thread_record();
+    record->next = state_->records;
+    while (!state_->records.compare_exchange_weak(record->next, record)) {
+    }
+    return record;
+  }
+  void unregister_thread(thread_record *record) {
+    record->in_use.store(false, std::memory_order_release);
+  }
+
+  // record of the calling thread, registered on first use and given back
+  // when the thread exits
+  thread_record *this_thread() {
+    struct thread_cache {
+      ~thread_cache() {
+        for (auto &entry : entries) {
+          entry.second->in_use.store(false, std::memory_order_release);
+        }
+      }
+
+      std::vector<std::pair<std::shared_ptr<shared_state>, thread_record *>>
+          entries;
+    };
+    thread_local thread_cache cache;
+
+    for (auto &entry : cache.entries) {
+      if (entry.first == state_) {
+        return entry.second;
+      }
+    }
+
+    auto closed = [](const std::pair<std::shared_ptr<shared_state>,
+                                     thread_record *> &entry) {
+      return entry.first->closed.load();
+    };
+    cache.entries.erase(std::remove_if(cache.entries.begin(),
+                                       cache.entries.end(), closed),
+                        cache.entries.end());
+    cache.entries.emplace_back(state_, register_thread());
+    return cache.entries.back().second;
+  }
+
+  // The announcement is a full barrier, nothing the thread reads afterwards
+  // can be older than the epoch it announced.
+  void enter(thread_record *record) {
+    if (record->depth++ == 0) {
+      record->epoch.exchange(state_->epoch.load());
+    }
+  }
+  void leave(thread_record *record) {
+    if (--record->depth == 0) {
+      record->epoch.store(0, std::memory_order_release);
+    }
+  }
+
+  // ptr must be unreachable for threads that enter from now on
+  void retire(thread_record *record, void *ptr,
+              void (*deleter)(void *context, void *ptr), void *context) {
+    record->limbo.push_back({state_->epoch.load(), ptr, deleter, context});
+    if (record->limbo.size() >= record->collect_size) {
+      try_advance();
+      collect(record);
+      record->collect_size =
+          std::max(collect_threshold, 2 * record->limbo.size());
+    }
+  }
+  void retire(void *ptr, void (*deleter)(void *context, void *ptr),
+              void *context) {
+    retire(this_thread(), ptr, deleter, context);
+  }
+
+  // moves the epoch on if every thread inside has seen it
+  bool try_advance() {
+    uint64_t epoch = state_->epoch.load();
+    for (thread_record *r = state_->records; r != nullptr; r = r->next) {
+      const uint64_t e = r->epoch.load();
+      if (e != 0 && e != epoch) {
+        return false;
+      }
+    }
+    return state_->epoch.compare_exchange_strong(epoch, epoch + 1);
+  }
+
+  // free what is old enough in record, and in the lists of exited threads
+  void collect(thread_record *record) {
+    collect_limbo(record);
+    for (thread_record *r = state_->records; r != nullptr; r = r->next) {
+      // the list is only read once the record is claimed, its owner may
+      // still be adding to it
+      bool idle = false;
+      if (r != record && r->in_use.compare_exchange_strong(idle, true)) {
+        if (!r->limbo.empty()) {
+          collect_limbo(r);
+        }
+        r->in_use.store(false, std::memory_order_release);
+      }
+    }
+  }
+  void collect_limbo(thread_record *record) {
+    const uint64_t epoch = state_->epoch.load();
+    std::size_t w = 0;
+    for (const retired_object &object : record->limbo) {
+      if (object.epoch + 2 <= epoch) {
+        object.deleter(object.context, object.ptr);
+      } else {
+        record->limbo[w++] = object;
+      }
+    }
+    record->limbo.resize(w);
+  }
+
+  // free everything retired so far that no thread can still see
+  void reclaim() {
+    try_advance();
+    try_advance();
+    collect(this_thread());
+  }
+
+  // free everything retired so far, no thread may be in a critical section
+  void release() {
+    for (thread_record *r = state_->records; r != nullptr; r = r->next) {
+      for (const retired_object &object : r->limbo) {
+        object.deleter(object.context, object.ptr);
+      }
+      r->limbo.clear();
+    }
+  }
+
+  constexpr static std::size_t collect_threshold = 64;
+
+  std::shared_ptr<shared_state> state_;
+};
+
+// Concurrent map on the nodes of art, with optimistic lock coupling. Readers
+// take no lock: a node is read between two loads of its version, and a child
+// is locked before its parent is checked again, so a reader starts over if a
+// writer got in its way. Writers go down the same way, then lock only the
+// nodes they change by upgrading the version they read them at, and start
+// over if one of them has moved on. A node is changed in place if that frees
+// nothing, and replaced otherwise, so readers never see a value or a heap
+// subfix freed. Replaced and erased nodes are retired to an epoch_manager,
+// every read and write is one critical section.
+//
+// The tree has no data node list, so a scan keeps the path it came down.
+// Each thread keeps free node slots of its own and goes to the shared node
+// allocators under a mutex once per batch. Values are copied out, since a
+// reference would outlive the version check. mapped_type must be copyable,
+// because a node with a value is copied instead of moved when it is replaced.
+template <typename K, typename T,
+          typename Alloc = art_slab_allocator<std::pair<const K, T>>>
+struct concurrent_art {
+  using key_type = K;
+  using mapped_type = T;
+  using value_type = std::pair<const key_type, mapped_type>;
+  using allocator_type = Alloc;
+  using key_traits = art_key_traits<key_type>;
+  using key_view = typename key_traits::view_type;
+
+  // the list would need every writer to lock both neighbours
+  using options = art_options<false, false>;
+  using tree_type = art_tree<key_type, value_type, allocator_type, options>;
+  template <typename V> using node_base = ::node_base<V, options>;
+  template <typename V> using node0 = ::node0<V, options>;
+  template <typename V> using node4 = ::node4<V, options>;
+  template <typename V> using child_slot = ::child_slot<V, options>;
+  template <typename V> using levellist = ::levellist<V, options>;
+  template <typename V> using node_inner = ::node_inner<V, options>;
+  using allocator_list = typename tree_type::allocator_list;
+
+  concurrent_art(const allocator_type &alloc = allocator_type())
+      : root_version_(0), t_(alloc) {}
+  concurrent_art(const concurrent_art &) = delete;
+  concurrent_art &operator=(const concurrent_art &) = delete;
+  ~concurrent_art() {
+    epochs_.release();
+    for (auto *r = epochs_.state_->records.load(); r != nullptr; r = r->next) {
+      if (r->local != nullptr) {
+        node_cache *cache = static_cast<node_cache *>(r->local);
+        drain_cache(*cache, allocator_list());
+        delete cache;
+        r->local = nullptr;
+      }
+    }
+    t_.clear();
+  }
+
+  std::size_t size() const {
+    return __atomic_load_n(&t_.impl_.size_, __ATOMIC_RELAXED);
+  }
+  bool empty() const { return size() == 0; }
+
+  bool insert(const value_type &value) {
+    node_base<value_type> *leaf = node_new<node0<value_type>>();
+    leaf->emplace_node_value(value);
+    return insert_leaf(leaf);
+  }
+  bool insert(value_type &&value) {
+    node_base<value_type> *leaf = node_new<node0<value_type>>();
+    leaf->emplace_node_value(std::move(value));
+    return insert_leaf(leaf);
+  }
+  std::size_t erase(key_view key) {
+    const auto encoded_key = key_traits::encode(key);
+    epoch_manager::guard guard(epochs_);
+    while (true) {
+      const int r = erase(encoded_key.data(), encoded_key.size());
+      if (r >= 0) {
+        return r;
+      }
+    }
+  }
+
+  bool find(key_view key, mapped_type &value) const {
+    const auto encoded_key = key_traits::encode(key);
+    epoch_manager::guard guard(epochs_);
+    const node_base<value_type> *node =
+        find_data_node(encoded_key.data(), encoded_key.size());
+    if (node == nullptr) {
+      return false;
+    }
+    // the value is never changed in place, and the node is not freed before
+    // the guard is gone
+    value = node->get_value().second;
+    return true;
+  }
+  std::size_t count(key_view key) const {
+    const auto encoded_key = key_traits::encode(key);
+    epoch_manager::guard guard(epochs_);
+    return find_data_node(encoded_key.data(), encoded_key.size()) != nullptr
+               ? 1
+               : 0;
+  }
+  // copy of the first element whose key is not less than key
+  bool lower_bound(key_view key, key_type &found_key,
+                   mapped_type &value) const {
+    bool found = false;
+    scan(key, [&](const value_type &v) {
+      found_key = v.first;
+      value = v.second;
+      found = true;
+      return false;
+    });
+    return found;
+  }
+  // Calls f on every element from lower_bound(from) on, in key order, until f
+  // returns false. Returns the number of calls. Keys inserted or erased during
+  // the scan may or may not be visited.
+  template <typename F> std::size_t scan(key_view from, F &&f) const {
+    const auto encoded_from = key_traits::encode(from);
+    std::basic_string<char_type> resume(encoded_from.data(),
+                                        encoded_from.size());
+    bool after = false; // resume is the last key visited
+    std::vector<path_node> path;
+    std::size_t n = 0;
+    epoch_manager::guard guard(epochs_);
+
+  restart:
+    if (!seek(resume, after, path)) {
+      goto restart;
+    }
+    while (!path.empty()) {
+      const value_type &value = path.back().node->get_value();
+      ++n;
+      if (!f(value)) {
+        return n;
+      }
+      const auto encoded_key = key_traits::encode(value.first);
+      resume.assign(encoded_key.data(), encoded_key.size());
+      after = true;
+      if (!next_data_node(path)) {
+        goto restart;
+      }
+    }
+    return n;
+  }
+
+  // Frees the retired nodes no reader can still be in. Writers do this as
+  // they go, but a thread that stops writing keeps its last few nodes.
+  void reclaim() { epochs_.reclaim(); }
+
+  // Version word: bit 0 is set once the node is replaced, bit 1 while a
+  // writer holds it, and every unlock counts up from bit 2.
+  constexpr static uint32_t obsolete_bit = 1;
+  constexpr static uint32_t locked_bit = 2;
+
+  // A node on the way down, at the version it was read at. nullptr stands
+  // for the root slot, which has its own version word.
+  struct path_node {
+    node_base<value_type> *node;
+    uint32_t version;
+    char_type c; // byte of node in its parent
+  };
+
+  std::atomic<uint32_t> &lock_word(node_base<value_type> *node) const {
+    return node != nullptr ? node->version_ : root_version_;
+  }
+  // false if the node is obsolete, waits for the writer if it is locked
+  static bool read_lock(const std::atomic<uint32_t> &word, uint32_t &version) {
+    version = word.load(std::memory_order_acquire);
+    while ((version & locked_bit) != 0) {
+      std::this_thread::yield();
+      version = word.load(std::memory_order_acquire);
+    }
+    return (version & obsolete_bit) == 0;
+  }
+  static bool read_lock(const node_base<value_type> *node, uint32_t &version) {
+    return read_lock(node->version_, version);
+  }
+  // true if nothing read from node since read_lock() was changed
+  static bool validate(const std::atomic<uint32_t> &word, uint32_t version) {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return word.load(std::memory_order_relaxed) == version;
+  }
+  static bool validate(const node_base<value_type> *node, uint32_t version) {
+    return validate(node->version_, version);
+  }
+  // write lock of a node that is still at the version it was read at
+  bool upgrade(const path_node &p) {
+    uint32_t version = p.version;
+    if (!lock_word(p.node).compare_exchange_strong(
+            version, version + locked_bit, std::memory_order_acquire)) {
+      return false;
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    return true;
+  }
+  // all of nodes locked in order, or none of them
+  bool upgrade(std::initializer_list<const path_node *> nodes) {
+    for (auto it = nodes.begin(); it != nodes.end(); ++it) {
+      if (!upgrade(**it)) {
+        while (it != nodes.begin()) {
+          write_unlock((*--it)->node);
+        }
+        return false;
+      }
+    }
+    return true;
+  }
+  void write_unlock(node_base<value_type> *node) {
+    lock_word(node).fetch_add(locked_bit, std::memory_order_release);
+  }
+  // Node is locked and no longer reachable for new readers. It is unlocked
+  // as obsolete, and freed once the readers already in it are gone.
+  void retire(node_base<value_type> *node) {
+    node->version_.fetch_add(locked_bit | obsolete_bit,
+                             std::memory_order_release);
+    epochs_.retire(node, &delete_node, this);
+  }
+  static void delete_node(void *tree, void *node) {
+    static_cast<concurrent_art *>(tree)->node_delete(
+        static_cast<node_base<value_type> *>(node));
+  }
+
+  // Free slots of one thread, one list per node type and one for the values
+  // of inner nodes. The allocators are shared by every writer and by epoch
+  // collection, a thread goes to them under alloc_mutex_ once per
+  // cache_batch slots it takes or gives back. The node counters of t_ are
+  // not kept.
+  struct node_cache {
+    std::array<std::vector<void *>, allocator_list::size> slots;
+  };
+  constexpr static std::size_t cache_batch = 32;
+
+  // slots of slot_type cached by the calling thread
+  template <typename slot_type> std::vector<void *> &cache_slots() {
+    epoch_manager::thread_record *record = epochs_.this_thread();
+    if (record->local == nullptr) {
+      record->local = new node_cache();
+    }
+    return static_cast<node_cache *>(record->local)
+        ->slots[allocator_list::template find<slot_type>()];
+  }
+  template <typename slot_type>
+  using node_allocator =
+      typename tree_type::template node_alloca_traits_rebind<slot_type>;
+
+  template <typename slot_type> slot_type *slot_new() {
+    std::vector<void *> &slots = cache_slots<slot_type>();
+    if (slots.empty()) {
+      std::lock_guard<std::mutex> lock(alloc_mutex_);
+      for (std::size_t i = 0; i < cache_batch; ++i) {
+        slots.push_back(
+            static_cast<node_allocator<slot_type> &>(t_.impl_).allocate(1));
+      }
+    }
+    slot_type *p = static_cast<slot_type *>(slots.back());
+    slots.pop_back();
+    return p;
+  }
+  template <typename slot_type> void slot_delete(slot_type *p) {
+    std::vector<void *> &slots = cache_slots<slot_type>();
+    slots.push_back(p);
+    if (slots.size() >= 2 * cache_batch) {
+      std::lock_guard<std::mutex> lock(alloc_mutex_);
+      for (std::size_t i = 0; i < cache_batch; ++i) {
+        static_cast<node_allocator<slot_type> &>(t_.impl_).deallocate(
+            static_cast<slot_type *>(slots.back()), 1);
+        slots.pop_back();
+      }
+    }
+  }
+
+  template <typename node_type> node_base<value_type> *node_new() {
+    node_type *node = new (slot_new<node_type>()) node_type();
+    node->type_ = node_base<value_type>::template type_of<node_type>();
+    return node;
+  }
+  // art_tree::node_emplace_value, node is not published yet
+  template <typename... Args>
+  void node_emplace_value(node_base<value_type> *node, Args &&...args) {
+    if (!node->value_boxed()) {
+      node->emplace_node_value(std::forward<Args>(args)...);
+      return;
+    }
+    value_type *&box = static_cast<node_inner<value_type> *>(node)->value_;
+    box = slot_new<value_type>();
+    try {
+      node->emplace_node_value(std::forward<Args>(args)...);
+    } catch (...) {
+      slot_delete(box);
+      box = nullptr;
+      throw;
+    }
+  }
+  node_base<value_type> *node_new_like(node_base<value_type> *node) {
+    return node_visit(node, [this](auto *n) -> node_base<value_type> * {
+      return node_new<typename std::remove_pointer<decltype(n)>::type>();
+    });
+  }
+  // the next node type in levellist
+  node_base<value_type> *node_expand_new(node_base<value_type> *node) {
+    return node_visit(node, [this](auto *n) -> node_base<value_type> * {
+      using node_type = typename std::remove_pointer<decltype(n)>::type;
+      return node_new<typename levellist<value_type>::template get_type<
+          levellist<value_type>::template find<node_type>() + 1>>();
+    });
+  }
+  // the previous node type in levellist
+  node_base<value_type> *node_shrink_new(node_base<value_type> *node) {
+    return node_visit(node, [this](auto *n) -> node_base<value_type> * {
+      using node_type = typename std::remove_pointer<decltype(n)>::type;
+      constexpr std::size_t level =
+          levellist<value_type>::template find<node_type>();
+      if (level == 0) {
+        throw "node0 shrink";
+      }
+      return node_new<typename levellist<value_type>::template get_type<
+          level == 0 ? 0 : level - 1>>();
+    });
+  }
+  void node_delete(node_base<value_type> *node) {
+    node->clear_node_storage();
+    if (node->value_boxed()) {
+      value_type *box = static_cast<node_inner<value_type> *>(node)->value_;
+      if (box != nullptr) {
+        slot_delete(box);
+      }
+    }
+    node_visit(node, [this](auto *n) {
+      using node_type = typename std::remove_pointer<decltype(n)>::type;
+      n->~node_type();
+      slot_delete(n);
+    });
+  }
+  // give every cached slot back, no thread uses the tree any more
+  template <typename slot_type> void drain_cache(node_cache &cache) {
+    for (void *p : cache.slots[allocator_list::template find<slot_type>()]) {
+      static_cast<node_allocator<slot_type> &>(t_.impl_).deallocate(
+          static_cast<slot_type *>(p), 1);
+    }
+  }
+  template <typename... slot_type>
+  void drain_cache(node_cache &cache, typelist<slot_type...>) {
+    (void)std::initializer_list<int>{(drain_cache<slot_type>(cache), 0)...};
+  }
+
+  template <typename P> static P load_pointer(P const *ptr) {
+    return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+  }
+
+  struct read_result {
+    node_base<value_type> *node;
+    uint32_t version;
+    std::size_t key_cur;
+    std::size_t node_sub_cur;
+    std::size_t subfix_size;
+  };
+
+  // child of node in slot, node is checked before and after it is locked
+  static bool read_child(node_base<value_type> *node, uint32_t version,
+                         child_slot<value_type> slot,
+                         node_base<value_type> *&child,
+                         uint32_t &child_version) {
+    child = slot.node == nullptr ? nullptr : load_pointer(slot.node);
+    if (!validate(node, version)) {
+      return false;
+    }
+    if (child == nullptr) {
+      return true;
+    }
+    return read_lock(child, child_version) && validate(node, version);
+  }
+  // The subfix of node read at version, subfix_size bytes. A long inner
+  // subfix is read from the key of the first data node below, each node on
+  // the way is validated before its child is used. False means start over.
+  static bool read_subfix(node_base<value_type> *node, uint32_t version,
+                          std::size_t subfix_size, const char_type *&subfix) {
+    if (!node->subfix_in_leaf()) {
+      subfix = node->subfix_head();
+      return validate(node, version);
+    }
+    if constexpr (key_traits::bytes_in_key) {
+      std::size_t rest = subfix_size;
+      do {
+        node_base<value_type> *child;
+        uint32_t child_version;
+        if (!read_child(node, version, node->find_min_child(), child,
+                        child_version) ||
+            child == nullptr) {
+          return false;
+        }
+        rest += 1 + child->subfix_size_;
+        node = child;
+        version = child_version;
+      } while (!node->storage_valid_);
+      const auto key = key_traits::encode(node->get_value().first);
+      if (rest > key.size()) {
+        return false;
+      }
+      subfix = key.data() + key.size() - rest;
+    }
+    return validate(node, version);
+  }
+  // the root node locked at version, checked against the root slot
+  bool read_root(path_node &root, node_base<value_type> *&node,
+                 uint32_t &version) const {
+    root = {nullptr, 0, 0};
+    read_lock(root_version_, root.version);
+    node = load_pointer(&t_.impl_.root_);
+    if (node == nullptr) {
+      return validate(root_version_, root.version);
+    }
+    return read_lock(node, version) && validate(root_version_, root.version);
+  }
+
+  // Optimistic art_tree::find_last_node. Nothing read from a node is used
+  // before the node is validated, false means start over.
+  bool find_last_node(const char_type *key, std::size_t key_size,
+                      read_result &result) const {
+    path_node root;
+    node_base<value_type> *node;
+    uint32_t version;
+    if (!read_root(root, node, version)) {
+      return false;
+    }
+    if (node == nullptr) {
+      result.node = nullptr;
+      return true;
+    }
+
+    std::size_t cursor = 0;
+    while (true) {
+      const std::size_t subfix_size = node->subfix_size_;
+      const char_type *subfix = nullptr;
+      if (!read_subfix(node, version, subfix_size, subfix)) {
+        return false;
+      }
+
+      auto r = node_base<value_type>::compare_subfix(
+          subfix, subfix_size, key + cursor, key_size - cursor);
+      if (cursor + r.first < key_size && r.first == subfix_size) {
+        node_base<value_type> *child;
+        uint32_t child_version;
+        if (!read_child(node, version,
+                        node->find_child(key[cursor + r.first]), child,
+                        child_version)) {
+          return false;
+        }
+        if (child != nullptr) {
+          cursor += r.first + 1;
+          node = child;
+          version = child_version;
+          continue;
+        }
+      }
+
+      result.node = node;
+      result.version = version;
+      result.key_cur = cursor + r.first;
+      result.node_sub_cur = r.first;
+      result.subfix_size = subfix_size;
+      return validate(node, version);
+    }
+  }
+  const node_base<value_type> *find_data_node(const char_type *key,
+                                              std::size_t key_size) const {
+    read_result r;
+    while (!find_last_node(key, key_size, r)) {
+    }
+    if (r.node != nullptr && r.key_cur == key_size &&
+        r.node_sub_cur == r.subfix_size && r.node->storage_valid_) {
+      return r.node;
+    }
+    return nullptr;
+  }
+
+  // push the child of the last node in path found in slot, if there is one
+  static bool push_child(std::vector<path_node> &path,
+                         child_slot<value_type> slot, bool &pushed) {
+    const path_node &top = path.back();
+    node_base<value_type> *child;
+    uint32_t child_version;
+    if (!read_child(top.node, top.version, slot, child, child_version)) {
+      return false;
+    }
+    pushed = child != nullptr;
+    if (pushed) {
+      path.push_back({child, child_version, slot.c});
+    }
+    return true;
+  }
+  // go down to the first data node under the last node in path
+  static bool min_data_node(std::vector<path_node> &path) {
+    while (!path.back().node->storage_valid_) {
+      bool pushed;
+      if (!push_child(path, path.back().node->find_min_child(), pushed) ||
+          !pushed) {
+        return false;
+      }
+    }
+    return true;
+  }
+  // the first data node after the subtree of the last node in path, path is
+  // empty at the end
+  static bool next_subtree(std::vector<path_node> &path) {
+    while (path.size() > 1) {
+      const char_type c = path.back().c;
+      path.pop_back();
+      bool pushed;
+      if (!push_child(path, path.back().node->find_greater_child(c), pushed)) {
+        return false;
+      }
+      if (pushed) {
+        return min_data_node(path);
+      }
+    }
+    path.clear();
+    return true;
+  }
+  // the data node after the last node in path, its children come first
+  static bool next_data_node(std::vector<path_node> &path) {
+    bool pushed;
+    if (!push_child(path, path.back().node->find_min_child(), pushed)) {
+      return false;
+    }
+    return pushed ? min_data_node(path) : next_subtree(path);
+  }
+  // Optimistic art_tree::lower_bound, or upper_bound if after. path ends at
+  // the data node found, or is empty at the end.
+  bool seek(const std::basic_string<char_type> &key, bool after,
+            std::vector<path_node> &path) const {
+    path.clear();
+    path_node root;
+    node_base<value_type> *node;
+    uint32_t version;
+    if (!read_root(root, node, version)) {
+      return false;
+    }
+    if (node == nullptr) {
+      return true;
+    }
+    path.push_back({node, version, 0});
+
+    std::size_t cursor = 0;
+    while (true) {
+      const std::size_t subfix_size = node->subfix_size_;
+      const char_type *subfix = nullptr;
+      if (!read_subfix(node, version, subfix_size, subfix)) {
+        return false;
+      }
+
+      auto r = node_base<value_type>::compare_subfix(
+          subfix, subfix_size, key.data() + cursor, key.size() - cursor);
+      const bool key_end = cursor + r.first == key.size();
+      if (r.first < subfix_size) {
+        // every key under node is greater, or every key is less
+        const bool greater = key_end || subfix[r.first] > key[cursor + r.first];
+        if (!validate(node, version)) {
+          return false;
+        }
+        return greater ? min_data_node(path) : next_subtree(path);
+      }
+      if (key_end) {
+        if (node->storage_valid_ && !after) {
+          return validate(node, version);
+        }
+        return next_data_node(path);
+      }
+
+      const char_type c = key[cursor + r.first];
+      bool pushed;
+      if (!push_child(path, node->find_child(c), pushed)) {
+        return false;
+      }
+      if (!pushed) {
+        if (!push_child(path, node->find_greater_child(c), pushed)) {
+          return false;
+        }
+        return pushed ? min_data_node(path) : next_subtree(path);
+      }
+      node = path.back().node;
+      version = path.back().version;
+      cursor += r.first + 1;
+    }
   }
-  std::size_t erase(const key_type &key) {
-    iterator iter = find(key);
-    if (iter != end()) {
-      erase(iter);
-      return 1;
+
+  // Point the slot of c in parent, or the root if parent is nullptr, at node.
+  // The parent is locked, so readers that loaded the old pointer fail to
+  // validate it.
+  void publish_node(node_base<value_type> *parent, char_type c,
+                    node_base<value_type> *node) {
+    node->parent_ = parent;
+    node->parent_c_ = c;
+    if (parent == nullptr) {
+      __atomic_store_n(&t_.impl_.root_, node, __ATOMIC_RELEASE);
+      return;
     }
-    return 0;
+    __atomic_store_n(parent->find_child(c).node, node, __ATOMIC_RELEASE);
   }
-  void swap(art &other) { t_.swap(other.t_); }
 
-  std::size_t count(const key_type &key) const {
-    const_iterator iter = find(key);
-    if (iter != end()) {
-      return 1;
-    }
-    return 0;
+  bool node_full(node_base<value_type> *node) {
+    return node_visit(node, [](auto *n) {
+      return n->children_size_ >= n->max_children_size;
+    });
   }
-  iterator find(const key_type &key) {
-    art::const_iterator citer = const_cast<const art &>(*this).find(key);
-    iterator iter;
-    iter.l_ = const_cast<node_link_base *>(citer.l_);
-    return iter;
+  int shrink_size(node_base<value_type> *node) {
+    return node_visit(
+        node, [](auto *n) -> int { return n->shrink_children_size; });
   }
-  const_iterator find(const key_type &key) const {
-    auto r = t_.find(key);
-    if (r.second) {
-      const_iterator iter;
-      iter.l_ = r.first;
-      return iter;
+  void copy_children(node_base<value_type> *node,
+                     node_base<value_type> *new_node) {
+    child_slot<value_type> slots[256];
+    int slot_size = node->get_all_children(slots);
+    for (int i = 0; i < slot_size; ++i) {
+      new_node->try_insert_child(slots[i].c, *slots[i].node);
     }
-    return end();
   }
-  std::pair<iterator, iterator> equal_range(const key_type &key) {
-    auto r = const_cast<const art &>(*this).equal_range(key);
-    iterator i1, i2;
-    i1.l_ = const_cast<node_link_base *>(r.first.l_);
-    i2.l_ = const_cast<node_link_base *>(r.second.l_);
-    return {i1, i2};
-  }
-  std::pair<const_iterator, const_iterator>
-  equal_range(const key_type &key) const {
-    const_iterator iter = find(key);
-    if (iter != end()) {
-      const_iterator tmp = iter;
-      ++iter;
-      return {tmp, iter};
+  // art_tree::node_move, but node stays intact for the readers in it
+  node_base<value_type> *node_copy(node_base<value_type> *node,
+                                   node_base<value_type> *new_node) {
+    copy_children(node, new_node);
+    if (node->storage_valid_) {
+      node_emplace_value(new_node, node->get_value());
     }
-    return {end(), end()};
-  }
-  iterator lower_bound(const key_type &key) {
-    const_iterator citer = const_cast<const art &>(*this).lower_bound(key);
-    iterator iter;
-    iter.l_ = const_cast<node_link_base *>(citer.l_);
-    return iter;
+    new_node->set_node_subfix(node->subfix_head(), node->subfix_size_);
+    return new_node;
   }
-  const_iterator lower_bound(const key_type &key) const {
-    const node_link_base *node = t_.lower_bound(key).first;
-    if (node == nullptr) {
-      return end();
+
+  // art_tree::emplace of a node0 no other thread can see yet. The key is
+  // read from the value of leaf, which is only given away once every lock
+  // the change needs is held.
+  bool insert_leaf(node_base<value_type> *leaf) {
+    const auto encoded_key = key_traits::encode(leaf->get_value().first);
+    const char_type *key = encoded_key.data();
+    const std::size_t key_size = encoded_key.size();
+    epoch_manager::guard guard(epochs_);
+
+  restart:
+    path_node parent;
+    path_node node;
+    if (!read_root(parent, node.node, node.version)) {
+      goto restart;
+    }
+    if (node.node == nullptr) {
+      if (!upgrade(parent)) {
+        goto restart;
+      }
+      leaf->set_node_subfix(key, key_size);
+      publish_node(nullptr, 0, leaf);
+      write_unlock(nullptr);
+      __atomic_fetch_add(&t_.impl_.size_, 1, __ATOMIC_RELAXED);
+      return true;
     }
+    node.c = 0;
 
-    const_iterator iter;
-    iter.l_ = node;
-    return iter;
-  }
-  iterator upper_bound(const key_type &key) {
-    const_iterator citer = const_cast<const art &>(*this).upper_bound(key);
-    iterator iter;
-    iter.l_ = const_cast<node_link_base *>(citer.l_);
-    return iter;
+    std::size_t cursor = 0;
+    while (true) {
+      node_base<value_type> *n = node.node;
+      const std::size_t subfix_size = n->subfix_size_;
+      const char_type *subfix = nullptr;
+      if (!read_subfix(n, node.version, subfix_size, subfix)) {
+        goto restart;
+      }
+      auto r = node_base<value_type>::compare_subfix(
+          subfix, subfix_size, key + cursor, key_size - cursor);
+      const std::size_t rest = key_size - cursor - r.first;
+
+      if (r.first < subfix_size) {
+        // split node, make parent node and hold this node. subfix was read
+        // at the version now locked, and the keys it points into are kept.
+        if (!upgrade({&parent, &node})) {
+          goto restart;
+        }
+        const char_type node_key_c = subfix[r.first];
+        node_base<value_type> *new_parent_node = node_new<node4<value_type>>();
+        if (rest == 0) {
+          node_emplace_value(new_parent_node, std::move(leaf->get_value()));
+          new_parent_node->set_node_subfix(nullptr, r.first);
+        } else {
+          leaf->set_node_subfix(key + key_size - (rest - 1), rest - 1);
+          new_parent_node->set_node_subfix(subfix, r.first);
+          new_parent_node->try_insert_child(key[cursor + r.first], leaf);
+        }
+
+        new_parent_node->try_insert_child(node_key_c, n);
+        publish_node(parent.node, node.c, new_parent_node);
+        // readers that got to node through the old slot fail to validate the
+        // parent once node is unlocked
+        n->set_node_subfix(subfix + r.first + 1, subfix_size - r.first - 1);
+        write_unlock(n);
+        write_unlock(parent.node);
+        if (rest == 0) {
+          node_delete(leaf);
+        }
+        break;
+      }
+
+      if (rest == 0) {
+        if (n->storage_valid_) {
+          if (!validate(n, node.version)) {
+            goto restart;
+          }
+          node_delete(leaf);
+          return false;
+        }
+        // give the value to a copy of this node
+        if (!upgrade({&parent, &node})) {
+          goto restart;
+        }
+        node_base<value_type> *new_node = node_new_like(n);
+        node_emplace_value(new_node, std::move(leaf->get_value()));
+        new_node->set_node_subfix(nullptr, subfix_size);
+        copy_children(n, new_node);
+        publish_node(parent.node, node.c, new_node);
+        retire(n);
+        write_unlock(parent.node);
+        node_delete(leaf);
+        break;
+      }
+
+      const char_type c = key[cursor + r.first];
+      path_node child;
+      if (!read_child(n, node.version, n->find_child(c), child.node,
+                      child.version)) {
+        goto restart;
+      }
+      if (child.node != nullptr) {
+        child.c = c;
+        parent = node;
+        node = child;
+        cursor += r.first + 1;
+        continue;
+      }
+
+      // append to this node child
+      leaf->set_node_subfix(key + key_size - (rest - 1), rest - 1);
+      if (!node_full(n)) {
+        // a node that is not obsolete is still in the tree
+        if (!upgrade(node)) {
+          goto restart;
+        }
+        n->try_insert_child(c, leaf);
+        write_unlock(n);
+        break;
+      }
+      if (!upgrade({&parent, &node})) {
+        goto restart;
+      }
+      node_base<value_type> *expanded_node = node_copy(n, node_expand_new(n));
+      expanded_node->try_insert_child(c, leaf);
+      publish_node(parent.node, node.c, expanded_node);
+      retire(n);
+      write_unlock(parent.node);
+      break;
+    }
+
+    __atomic_fetch_add(&t_.impl_.size_, 1, __ATOMIC_RELAXED);
+    return true;
   }
-  const_iterator upper_bound(const key_type &key) const {
-    auto r = t_.lower_bound(key);
-    const node_link_base *node = r.first;
-    if (node == nullptr) {
-      return end();
+
+  // art_tree::erase, -1 means start over. The nodes the change touches are
+  // known before any of them is locked: the data node, its parent, and the
+  // grandparent and the sibling when the parent is shrunk or merged away.
+  int erase(const char_type *key, std::size_t key_size) {
+    path_node grand = {nullptr, 0, 0};
+    path_node parent;
+    path_node node;
+    if (!read_root(parent, node.node, node.version)) {
+      return -1;
+    }
+    if (node.node == nullptr) {
+      return 0;
     }
+    node.c = 0;
 
-    const_iterator iter;
-    iter.l_ = node;
+    std::size_t cursor = 0;
+    while (true) {
+      node_base<value_type> *n = node.node;
+      const std::size_t subfix_size = n->subfix_size_;
+      const char_type *subfix = nullptr;
+      if (!read_subfix(n, node.version, subfix_size, subfix)) {
+        return -1;
+      }
+      auto r = node_base<value_type>::compare_subfix(
+          subfix, subfix_size, key + cursor, key_size - cursor);
+      if (r.first < subfix_size) {
+        return validate(n, node.version) ? 0 : -1;
+      }
+      if (cursor + r.first == key_size) {
+        if (!n->storage_valid_) {
+          return validate(n, node.version) ? 0 : -1;
+        }
+        break;
+      }
+      const char_type c = key[cursor + r.first];
+      path_node child;
+      if (!read_child(n, node.version, n->find_child(c), child.node,
+                      child.version)) {
+        return -1;
+      }
+      if (child.node == nullptr) {
+        return 0;
+      }
+      child.c = c;
+      grand = parent;
+      parent = node;
+      node = child;
+      cursor += r.first + 1;
+    }
 
-    if (r.second) {
-      return ++iter;
+    node_base<value_type> *n = node.node;
+    const int children_size = n->children_size_;
+    if (children_size > 1) {
+      // keep a copy of this node without the value
+      if (!upgrade({&parent, &node})) {
+        return -1;
+      }
+      node_base<value_type> *new_node = node_new_like(n);
+      new_node->set_node_subfix(n->subfix_head(), n->subfix_size_);
+      copy_children(n, new_node);
+      publish_node(parent.node, node.c, new_node);
+      retire(n);
+      write_unlock(parent.node);
+    } else if (children_size == 1) {
+      path_node child;
+      const child_slot<value_type> slot = n->find_min_child();
+      if (!read_child(n, node.version, slot, child.node, child.version) ||
+          child.node == nullptr) {
+        return -1;
+      }
+      child.c = slot.c;
+      if (!upgrade({&parent, &node, &child})) {
+        return -1;
+      }
+      merge_child(parent.node, n, node.c, child.node, child.c);
+      write_unlock(parent.node);
+    } else if (parent.node == nullptr) {
+      if (!upgrade({&parent, &node})) {
+        return -1;
+      }
+      __atomic_store_n(&t_.impl_.root_, nullptr, __ATOMIC_RELEASE);
+      retire(n);
+      write_unlock(nullptr);
+    } else {
+      node_base<value_type> *p = parent.node;
+      const bool keep = p->storage_valid_ || p->children_size_ > 2;
+      const bool shrink = keep && p->children_size_ - 1 <= shrink_size(p);
+      if (!validate(p, parent.version)) {
+        return -1;
+      }
+      if (keep && !shrink) {
+        if (!upgrade({&parent, &node})) {
+          return -1;
+        }
+        p->erase_child(node.c);
+        retire(n);
+        write_unlock(p);
+      } else if (keep) {
+        if (!upgrade({&grand, &parent, &node})) {
+          return -1;
+        }
+        p->erase_child(node.c);
+        retire(n);
+        node_base<value_type> *shrunk_node = node_copy(p, node_shrink_new(p));
+        publish_node(grand.node, parent.c, shrunk_node);
+        retire(p);
+        write_unlock(grand.node);
+      } else {
+        // parent is left with one child, merge the two
+        path_node sibling;
+        child_slot<value_type> slot = p->find_min_child();
+        if (slot.c == node.c) {
+          slot = p->find_max_child();
+        }
+        if (!read_child(p, parent.version, slot, sibling.node,
+                        sibling.version) ||
+            sibling.node == nullptr) {
+          return -1;
+        }
+        sibling.c = slot.c;
+        if (!upgrade({&grand, &parent, &node, &sibling})) {
+          return -1;
+        }
+        retire(n);
+        merge_child(grand.node, p, parent.c, sibling.node, sibling.c);
+        write_unlock(grand.node);
+      }
     }
-    return iter;
+    __atomic_fetch_sub(&t_.impl_.size_, 1, __ATOMIC_RELAXED);
+    return 1;
+  }
+  // Replace node, which has child c as its only child left, with child. The
+  // parent, node and child are locked, node is retired.
+  void merge_child(node_base<value_type> *parent, node_base<value_type> *node,
+                   char_type node_c, node_base<value_type> *child,
+                   char_type c) {
+    // node is obsolete before child is unlocked, so readers that went
+    // through node do not see the longer subfix
+    publish_node(parent, node_c, child);
+    child->prepend_node_subfix(node, c);
+    retire(node);
+    write_unlock(child);
   }
 
-  allocator_type get_allocator() const { return t_.get_allocator(); }
-
-  art_tree<key_type, value_type, allocator_type> t_;
+  mutable std::atomic<uint32_t> root_version_;
+  std::mutex alloc_mutex_;
+  tree_type t_;
+  mutable epoch_manager epochs_;
 };
 
-/******************  node4  *******************/
+/******************  node_base  *******************/
+
+// Static dispatch on node_base::type_. Every call site is a switch that the
+// compiler can inline, instead of an indirect call through a vtable.
+template <typename V, typename P, typename F>
+inline decltype(auto) node_visit(node_base<V, P> *node, F &&f) {
+  switch (node->type_) {
+  case node_base<V, P>::template type_of<node0<V, P>>():
+    return f(static_cast<node0<V, P> *>(node));
+  case node_base<V, P>::template type_of<node4<V, P>>():
+    return f(static_cast<node4<V, P> *>(node));
+  case node_base<V, P>::template type_of<node16<V, P>>():
+    return f(static_cast<node16<V, P> *>(node));
+  case node_base<V, P>::template type_of<node48<V, P>>():
+    return f(static_cast<node48<V, P> *>(node));
+  case node_base<V, P>::template type_of<node256<V, P>>():
+    return f(static_cast<node256<V, P> *>(node));
+  }
+  throw "bad node type";
+}
+
+template <typename V, typename P, typename F>
+inline decltype(auto) node_visit(const node_base<V, P> *node, F &&f) {
+  switch (node->type_) {
+  case node_base<V, P>::template type_of<node0<V, P>>():
+    return f(static_cast<const node0<V, P> *>(node));
+  case node_base<V, P>::template type_of<node4<V, P>>():
+    return f(static_cast<const node4<V, P> *>(node));
+  case node_base<V, P>::template type_of<node16<V, P>>():
+    return f(static_cast<const node16<V, P> *>(node));
+  case node_base<V, P>::template type_of<node48<V, P>>():
+    return f(static_cast<const node48<V, P> *>(node));
+  case node_base<V, P>::template type_of<node256<V, P>>():
+    return f(static_cast<const node256<V, P> *>(node));
+  }
+  throw "bad node type";
+}
+
+template <typename V, typename P>
+inline std::size_t node_base<V, P>::node_size() const {
+  return node_visit(this, [](auto *n) { return n->node_size(); });
+}
+
+template <typename V, typename P>
+inline const_child_slot<V, P>
+node_base<V, P>::find_child_impl(char_type c) const {
+  return node_visit(this, [c](auto *n) { return n->find_child_impl(c); });
+}
+
+template <typename V, typename P>
+inline child_slot<V, P> node_base<V, P>::find_leq_child(char_type c) {
+  return node_visit(this, [c](auto *n) { return n->find_leq_child(c); });
+}
+
+template <typename V, typename P>
+inline child_slot<V, P> node_base<V, P>::find_geq_child(char_type c) {
+  return node_visit(this, [c](auto *n) { return n->find_geq_child(c); });
+}
+
+template <typename V, typename P>
+inline int node_base<V, P>::get_all_children_impl(child_slot<V, P> slots[256]) {
+  return node_visit(
+      this, [slots](auto *n) { return n->get_all_children_impl(slots); });
+}
+
+template <typename V, typename P>
+inline std::pair<child_slot<V, P>, bool>
+node_base<V, P>::try_insert_child_impl(char_type c, node_base *node) {
+  return node_visit(
+      this, [c, node](auto *n) { return n->try_insert_child_impl(c, node); });
+}
+
+template <typename V, typename P>
+inline void node_base<V, P>::erase_child(char_type c) {
+  node_visit(this, [c](auto *n) { n->erase_child(c); });
+}
+
+/******************  node_base end *******************/
+
+/******************  node0  *******************/
 
-template <typename V> inline std::size_t node4<V>::node_size() const {
+template <typename V, typename P>
+inline std::size_t node0<V, P>::node_size() const {
   return sizeof(decltype(*this));
 }
 
-template <typename V>
-inline const_child_slot<V> node4<V>::find_child_impl(char_type c) const {
-  const_child_slot<V> slot;
-  for (uint8_t i = 0; i < node4<V>::children_size_; ++i) {
-    if (keys_[i] == c) {
-      slot.c = c;
-      slot.node = &children_[i];
-      return slot;
-    }
-  }
+template <typename V, typename P>
+inline const_child_slot<V, P>
+node0<V, P>::find_child_impl([[maybe_unused]] char_type c) const {
+  const_child_slot<V, P> slot{};
   slot.node = nullptr;
   return slot;
 }
 
-template <typename V>
-inline child_slot<V> node4<V>::find_leq_child(char_type c) {
-  child_slot<V> slot;
-  slot.c = char_type_minium;
+template <typename V, typename P>
+inline child_slot<V, P>
+node0<V, P>::find_leq_child([[maybe_unused]] char_type c) {
+  child_slot<V, P> slot{};
   slot.node = nullptr;
-  for (uint8_t i = 0; i < node4<V>::children_size_; ++i) {
-    if (keys_[i] <= c && slot.c <= keys_[i]) {
-      slot.c = keys_[i];
-      slot.node = &children_[i];
-    }
-  }
   return slot;
 }
 
-template <typename V>
-inline child_slot<V> node4<V>::find_geq_child(char_type c) {
-  child_slot<V> slot;
-  slot.c = char_type_maxium;
+template <typename V, typename P>
+inline child_slot<V, P>
+node0<V, P>::find_geq_child([[maybe_unused]] char_type c) {
+  child_slot<V, P> slot{};
   slot.node = nullptr;
-  for (uint8_t i = 0; i < node4<V>::children_size_; ++i) {
-    if (keys_[i] >= c && slot.c >= keys_[i]) {
-      slot.c = keys_[i];
-      slot.node = &children_[i];
-    }
+  return slot;
+}
+
+template <typename V, typename P>
+inline int node0<V, P>::get_all_children_impl(
+    [[maybe_unused]] child_slot<V, P> slots[256]) {
+  return 0;
+}
+
+template <typename V, typename P>
+inline std::pair<child_slot<V, P>, bool>
+node0<V, P>::try_insert_child_impl([[maybe_unused]] char_type c,
+                                   [[maybe_unused]] node_base<V, P> *node) {
+  child_slot<V, P> slot{};
+  return {slot, false};
+}
+
+template <typename V, typename P>
+inline void node0<V, P>::erase_child([[maybe_unused]] char_type c) {
+  throw "erase no found";
+}
+
+/******************  node0 end *******************/
+
+/******************  node4  *******************/
+
+template <typename V, typename P>
+inline std::size_t node4<V, P>::node_size() const {
+  return sizeof(decltype(*this));
+}
+
+// SWAR compare on the 4 key bytes. Keys are compared as char_type, so when
+// it is signed the sign bit of every byte is flipped to get an unsigned byte
+// order first, like art_key_traits::flip().
+template <typename V, typename P>
+inline uint32_t node4<V, P>::keys_word() const {
+  uint32_t w;
+  std::memcpy(&w, keys_, sizeof(w));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  w = __builtin_bswap32(w);
+#endif
+  return w;
+}
+
+template <typename V, typename P>
+inline uint32_t node4<V, P>::valid_mask() const {
+  return static_cast<uint32_t>(
+      0x80808080ull & ((1ull << (node4<V, P>::children_size_ * 8)) - 1));
+}
+
+template <typename V, typename P>
+inline uint32_t node4<V, P>::eq_mask(char_type c) const {
+  const uint32_t x = keys_word() ^ (0x01010101u * static_cast<uint8_t>(c));
+  // exact up to the first equal byte, keys are unique so that is enough
+  return (x - 0x01010101u) & ~x & valid_mask();
+}
+
+template <typename V, typename P>
+inline uint32_t node4<V, P>::lt_mask(char_type c) const {
+  const uint32_t a = keys_word() ^ sign_bias;
+  const uint32_t b = (0x01010101u * static_cast<uint8_t>(c)) ^ sign_bias;
+  // high bit of every byte is a >= b
+  const uint32_t t = (a | 0x80808080u) - (b & 0x7f7f7f7fu);
+  const uint32_t ge = (a & ~b) | (~(a ^ b) & t);
+  return ~ge & valid_mask();
+}
+
+template <typename V, typename P>
+inline uint32_t node4<V, P>::gt_mask(char_type c) const {
+  const uint32_t a = (0x01010101u * static_cast<uint8_t>(c)) ^ sign_bias;
+  const uint32_t b = keys_word() ^ sign_bias;
+  const uint32_t t = (a | 0x80808080u) - (b & 0x7f7f7f7fu);
+  const uint32_t ge = (a & ~b) | (~(a ^ b) & t);
+  return ~ge & valid_mask();
+}
+
+template <typename V, typename P>
+inline const_child_slot<V, P> node4<V, P>::find_child_impl(char_type c) const {
+  const_child_slot<V, P> slot{};
+  const uint32_t mask = eq_mask(c);
+  if (mask == 0) {
+    slot.node = nullptr;
+    return slot;
+  }
+  slot.c = c;
+  slot.node = &children_[__builtin_ctz(mask) / 8];
+  return slot;
+}
+
+template <typename V, typename P>
+inline child_slot<V, P> node4<V, P>::find_leq_child(char_type c) {
+  child_slot<V, P> slot{};
+  const int n = __builtin_popcount(~gt_mask(c) & valid_mask());
+  if (n == 0) {
+    slot.node = nullptr;
+    return slot;
+  }
+  slot.c = keys_[n - 1];
+  slot.node = &children_[n - 1];
+  return slot;
+}
+
+template <typename V, typename P>
+inline child_slot<V, P> node4<V, P>::find_geq_child(char_type c) {
+  child_slot<V, P> slot{};
+  const int n = __builtin_popcount(lt_mask(c));
+  if (n == node4<V, P>::children_size_) {
+    slot.node = nullptr;
+    return slot;
   }
+  slot.c = keys_[n];
+  slot.node = &children_[n];
   return slot;
 }
 
-template <typename V>
-inline int node4<V>::get_all_children_impl(child_slot<V> slots[256]) {
-  for (uint8_t i = 0; i < node4<V>::children_size_; ++i) {
+template <typename V, typename P>
+inline int node4<V, P>::get_all_children_impl(child_slot<V, P> slots[256]) {
+  for (uint8_t i = 0; i < node4<V, P>::children_size_; ++i) {
     slots[i].c = keys_[i];
     slots[i].node = &children_[i];
   }
-  return node4<V>::children_size_;
+  return node4<V, P>::children_size_;
 }
 
-template <typename V>
-inline std::pair<child_slot<V>, bool>
-node4<V>::try_insert_child_impl(char_type c, node_base<V> *node) {
-  child_slot<V> slot;
-  if (node4<V>::children_size_ >= max_children_size) {
+template <typename V, typename P>
+inline std::pair<child_slot<V, P>, bool>
+node4<V, P>::try_insert_child_impl(char_type c, node_base<V, P> *node) {
+  child_slot<V, P> slot{};
+  if (node4<V, P>::children_size_ >= max_children_size) {
     return {slot, false};
   }
 
-  for (uint8_t i = 0; i < node4<V>::children_size_; ++i) {
-    if (keys_[i] == c) {
-      throw "re-insert child";
-    }
+  if (eq_mask(c) != 0) {
+    throw "re-insert child";
   }
 
-  keys_[node4<V>::children_size_] = c;
-  children_[node4<V>::children_size_] = node;
-  ++node4<V>::children_size_;
+  const int pos = __builtin_popcount(lt_mask(c));
+  const int n = node4<V, P>::children_size_;
+  std::memmove(keys_ + pos + 1, keys_ + pos, (n - pos) * sizeof(keys_[0]));
+  std::memmove(children_ + pos + 1, children_ + pos,
+               (n - pos) * sizeof(children_[0]));
+  keys_[pos] = c;
+  children_[pos] = node;
+  ++node4<V, P>::children_size_;
   return {slot, true};
 }
 
-template <typename V> inline void node4<V>::erase_child(char_type c) {
-  for (uint8_t i = 0; i < node4<V>::children_size_; ++i) {
-    if (keys_[i] == c && children_[i] != nullptr) {
-      keys_[i] = keys_[node4<V>::children_size_ - 1];
-      children_[i] = children_[node4<V>::children_size_ - 1];
-      --node4<V>::children_size_;
-      return;
-    }
+template <typename V, typename P>
+inline void node4<V, P>::erase_child(char_type c) {
+  const uint32_t mask = eq_mask(c);
+  if (mask == 0) {
+    throw "erase no found";
   }
-  throw "erase no found";
+
+  const int pos = __builtin_ctz(mask) / 8;
+  const int n = node4<V, P>::children_size_;
+  std::memmove(keys_ + pos, keys_ + pos + 1, (n - pos - 1) * sizeof(keys_[0]));
+  std::memmove(children_ + pos, children_ + pos + 1,
+               (n - pos - 1) * sizeof(children_[0]));
+  --node4<V, P>::children_size_;
 }
 
 /******************  node4 end *******************/
 
 /******************  node16  *******************/
 
-template <typename V> inline std::size_t node16<V>::node_size() const {
+template <typename V, typename P>
+inline std::size_t node16<V, P>::node_size() const {
   return sizeof(decltype(*this));
 }
 
-template <typename V>
-inline const_child_slot<V> node16<V>::find_child_impl(char_type c) const {
-  const_child_slot<V> slot;
-  for (uint8_t i = 0; i < node16<V>::children_size_; ++i) {
-    if (keys_[i] == c) {
-      slot.c = c;
-      slot.node = &children_[i];
-      return slot;
-    }
+template <typename V, typename P>
+inline unsigned node16<V, P>::valid_mask() const {
+  return (1u << node16<V, P>::children_size_) - 1;
+}
+
+#if defined(__SSE2__)
+
+// One byte-compare + movemask over all 16 keys. _mm_cmplt_epi8 and
+// _mm_cmpgt_epi8 are signed, so an unsigned char_type gets its sign bit
+// flipped first.
+template <typename V, typename P>
+inline unsigned node16<V, P>::eq_mask(char_type c) const {
+  const __m128i keys =
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(keys_));
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(keys, _mm_set1_epi8(c))) &
+         valid_mask();
+}
+
+template <typename V, typename P>
+inline unsigned node16<V, P>::lt_mask(char_type c) const {
+  const __m128i bias = _mm_set1_epi8(sign_bias);
+  const __m128i keys = _mm_xor_si128(
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(keys_)), bias);
+  return _mm_movemask_epi8(_mm_cmplt_epi8(
+             keys, _mm_xor_si128(_mm_set1_epi8(c), bias))) &
+         valid_mask();
+}
+
+template <typename V, typename P>
+inline unsigned node16<V, P>::gt_mask(char_type c) const {
+  const __m128i bias = _mm_set1_epi8(sign_bias);
+  const __m128i keys = _mm_xor_si128(
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(keys_)), bias);
+  return _mm_movemask_epi8(_mm_cmpgt_epi8(
+             keys, _mm_xor_si128(_mm_set1_epi8(c), bias))) &
+         valid_mask();
+}
+
+#else
+
+template <typename V, typename P>
+inline unsigned node16<V, P>::eq_mask(char_type c) const {
+  unsigned mask = 0;
+  for (uint8_t i = 0; i < node16<V, P>::children_size_; ++i) {
+    mask |= static_cast<unsigned>(keys_[i] == c) << i;
   }
-  slot.node = nullptr;
+  return mask;
+}
+
+template <typename V, typename P>
+inline unsigned node16<V, P>::lt_mask(char_type c) const {
+  unsigned mask = 0;
+  for (uint8_t i = 0; i < node16<V, P>::children_size_; ++i) {
+    mask |= static_cast<unsigned>(keys_[i] < c) << i;
+  }
+  return mask;
+}
+
+template <typename V, typename P>
+inline unsigned node16<V, P>::gt_mask(char_type c) const {
+  unsigned mask = 0;
+  for (uint8_t i = 0; i < node16<V, P>::children_size_; ++i) {
+    mask |= static_cast<unsigned>(keys_[i] > c) << i;
+  }
+  return mask;
+}
+
+#endif
+
+template <typename V, typename P>
+inline const_child_slot<V, P> node16<V, P>::find_child_impl(char_type c) const {
+  const_child_slot<V, P> slot{};
+  const unsigned mask = eq_mask(c);
+  if (mask == 0) {
+    slot.node = nullptr;
+    return slot;
+  }
+  slot.c = c;
+  slot.node = &children_[__builtin_ctz(mask)];
   return slot;
 }
 
-template <typename V>
-inline child_slot<V> node16<V>::find_leq_child(char_type c) {
-  child_slot<V> slot;
-  slot.c = char_type_minium;
-  slot.node = nullptr;
-  for (uint8_t i = 0; i < node16<V>::children_size_; ++i) {
-    if (keys_[i] <= c && slot.c <= keys_[i]) {
-      slot.c = keys_[i];
-      slot.node = &children_[i];
-    }
+template <typename V, typename P>
+inline child_slot<V, P> node16<V, P>::find_leq_child(char_type c) {
+  child_slot<V, P> slot{};
+  const int n = __builtin_popcount(~gt_mask(c) & valid_mask());
+  if (n == 0) {
+    slot.node = nullptr;
+    return slot;
   }
+  slot.c = keys_[n - 1];
+  slot.node = &children_[n - 1];
   return slot;
 }
 
-template <typename V>
-inline child_slot<V> node16<V>::find_geq_child(char_type c) {
-  child_slot<V> slot;
-  slot.c = char_type_maxium;
-  slot.node = nullptr;
-  for (uint8_t i = 0; i < node16<V>::children_size_; ++i) {
-    if (keys_[i] >= c && slot.c >= keys_[i]) {
-      slot.c = keys_[i];
-      slot.node = &children_[i];
-    }
+template <typename V, typename P>
+inline child_slot<V, P> node16<V, P>::find_geq_child(char_type c) {
+  child_slot<V, P> slot{};
+  const int n = __builtin_popcount(lt_mask(c));
+  if (n == node16<V, P>::children_size_) {
+    slot.node = nullptr;
+    return slot;
   }
+  slot.c = keys_[n];
+  slot.node = &children_[n];
   return slot;
 }
 
-template <typename V>
-inline int node16<V>::get_all_children_impl(child_slot<V> slots[256]) {
-  for (uint8_t i = 0; i < node16<V>::children_size_; ++i) {
+template <typename V, typename P>
+inline int node16<V, P>::get_all_children_impl(child_slot<V, P> slots[256]) {
+  for (uint8_t i = 0; i < node16<V, P>::children_size_; ++i) {
     slots[i].c = keys_[i];
     slots[i].node = &children_[i];
   }
-  return node16<V>::children_size_;
+  return node16<V, P>::children_size_;
 }
 
-template <typename V>
-inline std::pair<child_slot<V>, bool>
-node16<V>::try_insert_child_impl(char_type c, node_base<V> *node) {
-  child_slot<V> slot;
-  if (node16<V>::children_size_ >= max_children_size) {
+template <typename V, typename P>
+inline std::pair<child_slot<V, P>, bool>
+node16<V, P>::try_insert_child_impl(char_type c, node_base<V, P> *node) {
+  child_slot<V, P> slot{};
+  if (node16<V, P>::children_size_ >= max_children_size) {
     return {slot, false};
   }
 
-  for (uint8_t i = 0; i < node16<V>::children_size_; ++i) {
-    if (keys_[i] == c) {
-      throw "re-insert child";
-    }
+  if (eq_mask(c) != 0) {
+    throw "re-insert child";
   }
 
-  keys_[node16<V>::children_size_] = c;
-  children_[node16<V>::children_size_] = node;
-  ++node16<V>::children_size_;
+  const int pos = __builtin_popcount(lt_mask(c));
+  const int n = node16<V, P>::children_size_;
+  std::memmove(keys_ + pos + 1, keys_ + pos, (n - pos) * sizeof(keys_[0]));
+  std::memmove(children_ + pos + 1, children_ + pos,
+               (n - pos) * sizeof(children_[0]));
+  keys_[pos] = c;
+  children_[pos] = node;
+  ++node16<V, P>::children_size_;
   return {slot, true};
 }
 
-template <typename V> inline void node16<V>::erase_child(char_type c) {
-  for (uint8_t i = 0; i < node16<V>::children_size_; ++i) {
-    if (keys_[i] == c && children_[i] != nullptr) {
-      keys_[i] = keys_[node16<V>::children_size_ - 1];
-      children_[i] = children_[node16<V>::children_size_ - 1];
-      --node16<V>::children_size_;
-      return;
-    }
+template <typename V, typename P>
+inline void node16<V, P>::erase_child(char_type c) {
+  const unsigned mask = eq_mask(c);
+  if (mask == 0) {
+    throw "erase no found";
   }
-  throw "erase no found";
+
+  const int pos = __builtin_ctz(mask);
+  const int n = node16<V, P>::children_size_;
+  std::memmove(keys_ + pos, keys_ + pos + 1, (n - pos - 1) * sizeof(keys_[0]));
+  std::memmove(children_ + pos, children_ + pos + 1,
+               (n - pos - 1) * sizeof(children_[0]));
+  --node16<V, P>::children_size_;
 }
 
 /******************  node16 end *******************/
 
 /******************  node48  *******************/
 
-template <typename V> inline std::size_t node48<V>::node_size() const {
+template <typename V, typename P>
+inline std::size_t node48<V, P>::node_size() const {
   return sizeof(decltype(*this));
 }
 
-template <typename V>
-inline const_child_slot<V> node48<V>::find_child_impl(char_type c) const {
-  const_child_slot<V> slot;
+template <typename V, typename P>
+inline const_child_slot<V, P> node48<V, P>::find_child_impl(char_type c) const {
+  const_child_slot<V, P> slot{};
 
-  if (children_[children_index()[c]] == nullptr) {
+  if (children_[child_index(c)] == nullptr) {
     slot.node = nullptr;
     return slot;
   }
 
   slot.c = c;
-  slot.node = &children_[children_index()[c]];
+  slot.node = &children_[child_index(c)];
   return slot;
 }
 
-template <typename V>
-inline child_slot<V> node48<V>::find_leq_child(char_type c) {
-  child_slot<V> slot;
-  if (node48<V>::children_empty()) {
+template <typename V, typename P>
+inline child_slot<V, P> node48<V, P>::find_leq_child(char_type c) {
+  child_slot<V, P> slot{};
+  if (node48<V, P>::children_empty()) {
     slot.node = nullptr;
     return slot;
   }
 
-  for (int i = c; i >= char_type_minium; i--) {
-    if (children_[children_index()[i]] != nullptr) {
-      slot.c = i;
-      slot.node = &children_[children_index()[i]];
-      return slot;
-    }
+  if (!bitmap_.find_leq(c, &slot.c)) {
+    slot.node = nullptr;
+    return slot;
   }
-
-  slot.node = nullptr;
+  slot.node = &children_[child_index(slot.c)];
   return slot;
 }
 
-template <typename V>
-inline child_slot<V> node48<V>::find_geq_child(char_type c) {
-  child_slot<V> slot;
-  if (node48<V>::children_empty()) {
+template <typename V, typename P>
+inline child_slot<V, P> node48<V, P>::find_geq_child(char_type c) {
+  child_slot<V, P> slot{};
+  if (node48<V, P>::children_empty()) {
     slot.node = nullptr;
     return slot;
   }
 
-  for (int i = c; i <= char_type_maxium; ++i) {
-    if (children_[children_index()[i]] != nullptr) {
-      slot.c = i;
-      slot.node = &children_[children_index()[i]];
-      return slot;
-    }
+  if (!bitmap_.find_geq(c, &slot.c)) {
+    slot.node = nullptr;
+    return slot;
   }
-
-  slot.node = nullptr;
+  slot.node = &children_[child_index(slot.c)];
   return slot;
 }
 
-template <typename V>
-inline int node48<V>::get_all_children_impl(child_slot<V> slots[256]) {
-  if (node48<V>::children_empty()) {
+template <typename V, typename P>
+inline int node48<V, P>::get_all_children_impl(child_slot<V, P> slots[256]) {
+  if (node48<V, P>::children_empty()) {
     return 0;
   }
 
   int w = 0;
-  for (int i = char_type_minium; i <= char_type_maxium; ++i) {
-    if (children_[children_index()[i]] != nullptr) {
-      slots[w].c = static_cast<char>(i);
-      slots[w].node = &children_[children_index()[i]];
-      ++w;
-    }
-  }
+  bitmap_.for_each([&](char_type c) {
+    slots[w].c = c;
+    slots[w].node = &children_[child_index(c)];
+    ++w;
+  });
 
-  if (w != node48<V>::children_size_) {
+  if (w != node48<V, P>::children_size_) {
     throw "get all failed";
   }
 
-  return node48<V>::children_size_;
+  return node48<V, P>::children_size_;
 }
 
-template <typename V>
-inline std::pair<child_slot<V>, bool>
-node48<V>::try_insert_child_impl(char_type c, node_base<V> *node) {
-  child_slot<V> slot;
-  if (node48<V>::children_size_ >= max_children_size) {
+template <typename V, typename P>
+inline std::pair<child_slot<V, P>, bool>
+node48<V, P>::try_insert_child_impl(char_type c, node_base<V, P> *node) {
+  child_slot<V, P> slot{};
+  if (node48<V, P>::children_size_ >= max_children_size) {
     return {slot, false};
   }
 
-  if (children_[children_index()[c]] != nullptr) {
+  if (children_[child_index(c)] != nullptr) {
     throw "re-insert child";
   }
 
-  children_index()[c] = node48<V>::children_size_ + 1;
-  children_[children_index()[c]] = node;
-  ++node48<V>::children_size_;
+  child_index(c) = node48<V, P>::children_size_ + 1;
+  children_[child_index(c)] = node;
+  children_key_[child_index(c)] = c;
+  bitmap_.set(c);
+  ++node48<V, P>::children_size_;
   return {slot, true};
 }
 
-template <typename V> inline void node48<V>::erase_child(char_type c) {
-  if (children_[children_index()[c]] == nullptr) {
+template <typename V, typename P>
+inline void node48<V, P>::erase_child(char_type c) {
+  if (children_[child_index(c)] == nullptr) {
     throw "erase no found";
   }
 
-  char_type moved_index = children_index()[c];
-  node_base<V> *moved_node = children_[node48<V>::children_size_];
-  children_[children_index()[c]] = moved_node;
-  children_index()[c] = 0;
-
-  // if erase last children, dont need to search
-  if (moved_index != node48<V>::children_size_) {
-    for (int i = char_type_minium; i <= char_type_maxium; ++i) {
-      if (children_[children_index()[i]] == moved_node) {
-        children_index()[i] = moved_index;
-        break;
-      }
-    }
-  }
-
-  --node48<V>::children_size_;
+  // the last slot moves into the erased one
+  const uint8_t index = child_index(c);
+  const uint8_t last = node48<V, P>::children_size_;
+  const char_type moved_c = children_key_[last];
+  children_[index] = children_[last];
+  children_key_[index] = moved_c;
+  child_index(moved_c) = index;
+  children_[last] = nullptr;
+  child_index(c) = 0;
+  bitmap_.reset(c);
+
+  --node48<V, P>::children_size_;
 }
 
 /******************  node48 end *******************/
 
 /******************  node256  *******************/
 
-template <typename V> inline std::size_t node256<V>::node_size() const {
+template <typename V, typename P>
+inline std::size_t node256<V, P>::node_size() const {
   return sizeof(decltype(*this));
 }
 
-template <typename V>
-inline const_child_slot<V> node256<V>::find_child_impl(char_type c) const {
-  const_child_slot<V> slot;
-  if (children()[c] == nullptr) {
+template <typename V, typename P>
+inline const_child_slot<V, P>
+node256<V, P>::find_child_impl(char_type c) const {
+  const_child_slot<V, P> slot{};
+  if (child(c) == nullptr) {
     slot.node = nullptr;
     return slot;
   }
 
   slot.c = c;
-  slot.node = &children()[c];
+  slot.node = &child(c);
   return slot;
 }
 
-template <typename V>
-inline child_slot<V> node256<V>::find_leq_child(char_type c) {
-  child_slot<V> slot;
-  if (node256<V>::children_empty()) {
+template <typename V, typename P>
+inline child_slot<V, P> node256<V, P>::find_leq_child(char_type c) {
+  child_slot<V, P> slot{};
+  if (node256<V, P>::children_empty()) {
     slot.node = nullptr;
     return slot;
   }
 
-  for (int i = c; i > char_type_minium; i--) {
-    if (children()[i] != nullptr) {
-      slot.c = i;
-      slot.node = &children()[i];
-      return slot;
-    }
+  if (!bitmap_.find_leq(c, &slot.c)) {
+    slot.node = nullptr;
+    return slot;
   }
-
-  slot.node = nullptr;
+  slot.node = &child(slot.c);
   return slot;
 }
 
-template <typename V>
-inline child_slot<V> node256<V>::find_geq_child(char_type c) {
-  child_slot<V> slot;
-  if (node256<V>::children_empty()) {
+template <typename V, typename P>
+inline child_slot<V, P> node256<V, P>::find_geq_child(char_type c) {
+  child_slot<V, P> slot{};
+  if (node256<V, P>::children_empty()) {
     slot.node = nullptr;
     return slot;
   }
 
-  for (int i = c; i < char_type_maxium; ++i) {
-    if (children()[i] != nullptr) {
-      slot.c = i;
-      slot.node = &children()[i];
-      return slot;
-    }
+  if (!bitmap_.find_geq(c, &slot.c)) {
+    slot.node = nullptr;
+    return slot;
   }
-
-  slot.node = nullptr;
+  slot.node = &child(slot.c);
   return slot;
 }
 
-template <typename V>
-inline int node256<V>::get_all_children_impl(child_slot<V> slots[256]) {
-  if (node256<V>::children_empty()) {
+template <typename V, typename P>
+inline int node256<V, P>::get_all_children_impl(child_slot<V, P> slots[256]) {
+  if (node256<V, P>::children_empty()) {
     return 0;
   }
 
   int w = 0;
-  for (int i = char_type_minium; i <= char_type_maxium; ++i) {
-    if (children()[i] != nullptr) {
-      slots[w].c = static_cast<char>(i);
-      slots[w].node = &children()[i];
-      ++w;
-    }
-  }
+  bitmap_.for_each([&](char_type c) {
+    slots[w].c = c;
+    slots[w].node = &child(c);
+    ++w;
+  });
 
-  if (w != node256<V>::children_size_) {
+  if (w != node256<V, P>::children_size_) {
     throw "get all failed";
   }
 
-  return node256<V>::children_size_;
+  return node256<V, P>::children_size_;
 }
 
-template <typename V>
-inline std::pair<child_slot<V>, bool>
-node256<V>::try_insert_child_impl(char_type c, node_base<V> *node) {
-  if (node256<V>::children_size_ >= max_children_size) {
+template <typename V, typename P>
+inline std::pair<child_slot<V, P>, bool>
+node256<V, P>::try_insert_child_impl(char_type c, node_base<V, P> *node) {
+  if (node256<V, P>::children_size_ >= max_children_size) {
     throw "node256 overflow";
   }
 
-  if (children()[c] != nullptr) {
+  if (child(c) != nullptr) {
     throw "re-insert child";
   }
 
-  child_slot<V> slot;
-  children()[c] = node;
-  ++node256<V>::children_size_;
+  child_slot<V, P> slot{};
+  child(c) = node;
+  bitmap_.set(c);
+  ++node256<V, P>::children_size_;
   return {slot, true};
 }
 
-template <typename V> inline void node256<V>::erase_child(char_type c) {
-  if (children()[c] == nullptr) {
+template <typename V, typename P>
+inline void node256<V, P>::erase_child(char_type c) {
+  if (child(c) == nullptr) {
     throw "erase no found";
   }
 
-  children()[c] = nullptr;
-  --node256<V>::children_size_;
+  child(c) = nullptr;
+  bitmap_.reset(c);
+  --node256<V, P>::children_size_;
 }
 
 /******************  node256 end *******************/
@@ -2,6 +2,8 @@
 #include <algorithm>
 #include <chrono>
 #include <random>
+#include <sstream>
+#include <thread>
 
 using namespace std;
 
@@ -21,7 +23,7 @@ void print_preorder(art_tree<K, V, std::allocator<V>> &t, node_base<V> *node,
   }
   printf("subfix: {%lu, ", node->subfix_size_);
   for (std::size_t i = 0; i < node->subfix_size_; ++i) {
-    putchar(node->subfix_start_[i]);
+    putchar(node->subfix()[i]);
   }
   printf("}, ");
 
@@ -278,6 +280,1504 @@ void stress_test() {
   }
 }
 
+// keys made of the full byte range, ordered the same way as art (signed
+// char_type), also with an unlinked tree that steps through node48 and
+// node256 children to iterate
+template <typename Tree> void byte_key_test() {
+  struct char_less {
+    bool operator()(const string &a, const string &b) const {
+      return lexicographical_compare(a.begin(), a.end(), b.begin(), b.end());
+    }
+  };
+
+  mt19937 rng;
+  for (int alphabet : {3, 12, 40, 256}) {
+    map<string, int, char_less> m;
+    Tree t;
+    vector<string> v;
+
+    for (int i = 0; i < 20000; i++) {
+      string str((rng() % 3) + 1, '0');
+      for (auto &c : str) {
+        c = static_cast<char>(rng() % alphabet - alphabet / 2);
+      }
+      v.push_back(str);
+      if (m.insert({str, i}).second != t.insert({str, i}).second) {
+        throw "bad insert";
+      }
+    }
+
+    for (int i = 0; i < 20000; i++) {
+      string str((rng() % 4) + 1, '0');
+      for (auto &c : str) {
+        c = static_cast<char>(rng() % alphabet - alphabet / 2);
+      }
+
+      auto it1 = m.find(str);
+      auto it2 = t.find(str);
+      if ((it1 == m.end()) != (it2 == t.end())) {
+        throw "found bad key";
+      }
+
+      it1 = m.lower_bound(str);
+      it2 = t.lower_bound(str);
+      if ((it1 == m.end()) != (it2 == t.end()) ||
+          (it1 != m.end() && it1->first != it2->first)) {
+        throw "lower bound kv";
+      }
+
+      it1 = m.upper_bound(str);
+      it2 = t.upper_bound(str);
+      if ((it1 == m.end()) != (it2 == t.end()) ||
+          (it1 != m.end() && it1->first != it2->first)) {
+        throw "upper bound kv";
+      }
+    }
+
+    random_shuffle(v.begin(), v.end(), [&](size_t n) { return rng() % n; });
+    for (size_t i = 0; i < v.size(); i++) {
+      if (i % 1000 == 0) {
+        auto it = m.begin();
+        auto art_it = t.begin();
+        for (; it != m.end(); ++it, ++art_it) {
+          if (art_it->first != it->first) {
+            throw "bad key";
+          }
+        }
+        if (art_it != t.end()) {
+          throw "bad end";
+        }
+        for (auto rit = m.rbegin(); rit != m.rend(); ++rit) {
+          if ((--art_it)->first != rit->first) {
+            throw "bad reverse key";
+          }
+        }
+      }
+
+      if (m.erase(v[i]) != t.erase(v[i])) {
+        throw "erase bad";
+      }
+    }
+
+    if (t.size() != 0) {
+      throw "bad size";
+    }
+  }
+}
+
+void byte_key_test() {
+  byte_key_test<art<string, int>>();
+  byte_key_test<art<string, int, art_slab_allocator<pair<const string, int>>,
+                    art_options<false, false>>>();
+}
+
+// long shared prefixes, so inner nodes hold subfix of every size
+void long_prefix_test() {
+  mt19937 rng;
+  map<string, int> m;
+  art<string, int> t;
+  vector<string> v;
+
+  for (int i = 0; i < 50000; i++) {
+    string str = string(rng() % 100, 'a' + rng() % 3) + generate_rand_string();
+    str += string(rng() % 60, 'z');
+    v.push_back(str);
+    if (m.insert({str, i}).second != t.insert({str, i}).second) {
+      throw "bad insert";
+    }
+  }
+
+  // structural copy keeps the same shape
+  art<string, int> t2(t);
+  if (t2.t_.impl_.node_counter_ != t.t_.impl_.node_counter_) {
+    throw "bad copy";
+  }
+  t2.erase(t2.begin());
+  t = t2;
+
+  random_shuffle(v.begin(), v.end(), [&](size_t n) { return rng() % n; });
+  m.erase(m.begin());
+  for (size_t i = 0; i < v.size(); i++) {
+    if (m.erase(v[i]) != t.erase(v[i])) {
+      throw "erase bad";
+    }
+
+    if (i % 5000 == 0) {
+      auto it = m.begin();
+      auto art_it = t.begin();
+      for (; it != m.end(); ++it, ++art_it) {
+        if (art_it->first != it->first || art_it->second != it->second) {
+          throw "bad key";
+        }
+      }
+      if (art_it != t.end()) {
+        throw "bad end";
+      }
+    }
+  }
+}
+
+// nodes shrink back to smaller types after mass erase
+void shrink_test() {
+  using V = art<string, int>::value_type;
+  art<string, int> t;
+  for (int c = CHAR_MIN; c <= CHAR_MAX; c++) {
+    t.insert({string("k") + static_cast<char>(c), c});
+  }
+  if (t.t_.impl_.root_->node_size() != sizeof(node256<V>)) {
+    throw "bad expand";
+  }
+
+  for (int c = CHAR_MIN; c <= CHAR_MAX - 3; c++) {
+    t.erase(string("k") + static_cast<char>(c));
+  }
+  if (t.t_.impl_.root_->node_size() != sizeof(node4<V>)) {
+    throw "bad shrink";
+  }
+
+  t.insert({"k", 0});
+  for (int c = CHAR_MAX - 2; c <= CHAR_MAX; c++) {
+    t.erase(string("k") + static_cast<char>(c));
+  }
+  if (t.size() != 1 || t.t_.impl_.node_counter_ != 1 ||
+      t.t_.impl_.root_->node_size() != sizeof(node0<V>)) {
+    throw "bad shrink";
+  }
+}
+
+void bulk_load_test() {
+  mt19937 rng;
+  vector<pair<string, int>> v;
+  for (int i = 0; i < 100000; i++) {
+    string str = generate_rand_string();
+    if (i % 3 == 0) {
+      str = str.substr(0, rng() % str.size()); // prefix keys, maybe empty
+    }
+    v.push_back({str, i});
+  }
+
+  map<string, int> m(v.begin(), v.end());
+  vector<pair<string, int>> sorted(m.begin(), m.end());
+
+  // same shape as inserting one by one
+  art<string, int> t1(sorted.begin(), sorted.end());
+  art<string, int> t2;
+  for (auto &kv : sorted) {
+    t2.insert(kv);
+  }
+  if (t1.size() != m.size() ||
+      t1.t_.impl_.node_counter_ != t2.t_.impl_.node_counter_) {
+    throw "bad bulk load";
+  }
+
+  // duplicates are dropped, out of order tail is inserted
+  vector<pair<string, int>> dup = sorted;
+  dup.insert(dup.begin() + dup.size() / 2, sorted[dup.size() / 2]);
+  dup.push_back(sorted[0]);
+  dup.push_back({string(1, char(-1)) + "high", -1});
+  m.insert(dup.back());
+  art<string, int> t3;
+  t3.bulk_load(dup.begin(), dup.end());
+
+  for (auto &kv : m) {
+    auto art_it = t3.find(kv.first);
+    if (art_it == t3.end() || art_it->second != kv.second) {
+      throw "bad bulk load kv";
+    }
+  }
+  if (t3.size() != m.size()) {
+    throw "bad bulk load size";
+  }
+  for (auto it = t3.begin(), next = ++t3.begin(); next != t3.end();
+       ++it, ++next) {
+    if (!lexicographical_compare(it->first.begin(), it->first.end(),
+                                 next->first.begin(), next->first.end())) {
+      throw "bad bulk load order";
+    }
+  }
+
+  for (auto &kv : v) {
+    if (t3.erase(kv.first) != m.erase(kv.first)) {
+      throw "erase bad";
+    }
+  }
+}
+
+template <typename T, typename M> bool same_contents(T &t, const M &m) {
+  if (t.size() != m.size()) {
+    return false;
+  }
+  auto it = m.begin();
+  for (auto &kv : t) {
+    if (kv != *it++) {
+      return false;
+    }
+  }
+  return true;
+}
+
+template <typename K> void integer_key_test(K lo, K hi) {
+  mt19937_64 rng;
+  uniform_int_distribution<int64_t> dist(lo, hi);
+  map<K, int> m;
+  art<K, int> t;
+  for (int i = 0; i < 50000; i++) {
+    const K k = static_cast<K>(dist(rng));
+    if (t.insert({k, i}).second != m.insert({k, i}).second) {
+      throw "bad integer insert";
+    }
+  }
+  // keys share long prefixes near the ends of the range
+  for (K k = lo; k != static_cast<K>(lo + 300); ++k) {
+    t.insert({k, 0});
+    m.insert({k, 0});
+  }
+  for (K k = hi; k != static_cast<K>(hi - 300); --k) {
+    t.insert({k, 0});
+    m.insert({k, 0});
+  }
+  if (!same_contents(t, m)) {
+    throw "bad integer order";
+  }
+
+  for (int i = 0; i < 50000; i++) {
+    const K k = static_cast<K>(dist(rng));
+    auto it = m.lower_bound(k);
+    auto art_it = t.lower_bound(k);
+    if (it == m.end() ? art_it != t.end() : art_it->first != it->first) {
+      throw "bad integer lower_bound";
+    }
+    it = m.upper_bound(k);
+    art_it = t.upper_bound(k);
+    if (it == m.end() ? art_it != t.end() : art_it->first != it->first) {
+      throw "bad integer upper_bound";
+    }
+    if (t.count(k) != m.count(k)) {
+      throw "bad integer find";
+    }
+  }
+
+  vector<K> keys;
+  for (int i = 0; i < 1000; i++) {
+    keys.push_back(i % 2 ? m.begin()->first : static_cast<K>(dist(rng)));
+  }
+  vector<typename art<K, int>::iterator> results(keys.size());
+  t.multi_find(keys.data(), keys.size(), results.data());
+  for (size_t i = 0; i < keys.size(); i++) {
+    if (results[i] != t.find(keys[i])) {
+      throw "bad integer multi_find";
+    }
+  }
+
+  art<K, int> loaded(m.begin(), m.end());
+  if (loaded.t_.impl_.node_counter_ != t.t_.impl_.node_counter_ ||
+      !same_contents(loaded, m)) {
+    throw "bad integer bulk load";
+  }
+
+  for (auto &kv : vector<pair<K, int>>(m.begin(), m.end())) {
+    if (rng() % 2) {
+      t.erase(kv.first);
+      m.erase(kv.first);
+    }
+  }
+  if (!same_contents(t, m)) {
+    throw "bad integer erase";
+  }
+}
+
+void integer_key_test() {
+  integer_key_test<uint64_t>(0, numeric_limits<int64_t>::max());
+  integer_key_test<uint64_t>(0, 100000);
+  integer_key_test<int64_t>(numeric_limits<int64_t>::min() / 2,
+                            numeric_limits<int64_t>::max() / 2);
+  integer_key_test<uint32_t>(0, numeric_limits<uint32_t>::max());
+  integer_key_test<int32_t>(-100000, 100000);
+  integer_key_test<uint16_t>(0, numeric_limits<uint16_t>::max());
+
+  // no key string in the node
+  if (sizeof(node0<pair<const uint64_t, uint64_t>>) >=
+      sizeof(node0<pair<const string, uint64_t>>)) {
+    throw "bad integer node size";
+  }
+}
+
+template <typename Key, typename Gen> void tuple_key_test(Gen gen) {
+  using tuple_type = typename Key::tuple_type;
+  map<tuple_type, int> m;
+  art<Key, int> t;
+  for (int i = 0; i < 30000; i++) {
+    const tuple_type k = gen();
+    if (t.insert({k, i}).second != m.insert({k, i}).second) {
+      throw "bad tuple insert";
+    }
+  }
+
+  if (t.size() != m.size()) {
+    throw "bad tuple size";
+  }
+  auto it = m.begin();
+  for (auto &kv : t) {
+    if (kv.first.decode() != it->first || kv.second != it->second) {
+      throw "bad tuple order";
+    }
+    ++it;
+  }
+
+  for (int i = 0; i < 30000; i++) {
+    const tuple_type k = gen();
+    auto m_it = m.lower_bound(k);
+    auto art_it = t.lower_bound(k);
+    if (m_it == m.end() ? art_it != t.end()
+                        : art_it->first.decode() != m_it->first) {
+      throw "bad tuple lower_bound";
+    }
+    if (t.count(k) != m.count(k)) {
+      throw "bad tuple find";
+    }
+  }
+
+  vector<tuple_type> keys;
+  for (auto &kv : m) {
+    keys.push_back(kv.first);
+    keys.push_back(gen());
+  }
+  vector<typename art<Key, int>::iterator> results(keys.size());
+  t.multi_find(keys.data(), keys.size(), results.data());
+  for (size_t i = 0; i < keys.size(); i++) {
+    if (results[i] != t.find(keys[i])) {
+      throw "bad tuple multi_find";
+    }
+  }
+
+  for (auto &kv : m) {
+    if (t.erase(kv.first) != 1) {
+      throw "bad tuple erase";
+    }
+  }
+  if (!t.empty()) {
+    throw "bad tuple erase";
+  }
+}
+
+void tuple_key_test() {
+  mt19937_64 rng;
+  auto rand_string = [&]() {
+    string str(rng() % 6, 0);
+    for (auto &c : str) {
+      c = "\0\1a\x7f\x80\xff"[rng() % 6];
+    }
+    return str;
+  };
+  auto rand_double = [&]() {
+    const double d[] = {-1e300, -2.5, -1e-300, 0.0, 1e-300, 2.5, 1e300};
+    return rng() % 2 ? d[rng() % 7] : static_cast<double>(int64_t(rng()));
+  };
+
+  tuple_key_test<art_tuple_key<uint32_t, int64_t, double, string>>([&]() {
+    return make_tuple(uint32_t(rng() % 3), int64_t(rng() % 5) - 2,
+                      rand_double(), rand_string());
+  });
+  // strings that are not the last field are escaped and ended
+  tuple_key_test<art_tuple_key<string, float, int16_t, string>>([&]() {
+    return make_tuple(rand_string(), float(int(rng() % 2001) - 1000) / 8,
+                      int16_t(rng()), rand_string());
+  });
+
+  art_tuple_key<int32_t, string, double> key(-7, string("a\0b", 3), -0.5);
+  if (key.decode() != make_tuple(-7, string("a\0b", 3), -0.5)) {
+    throw "bad tuple decode";
+  }
+}
+
+void prefix_scan_test() {
+  mt19937 rng;
+  auto rand_key = [&](size_t max_size) {
+    string str(rng() % (max_size + 1), 0);
+    for (auto &c : str) {
+      c = "ab\xff"[rng() % 3];
+    }
+    return str;
+  };
+
+  art<string, int> t;
+  map<string, int> m;
+  for (int i = 0; i < 20000; i++) {
+    const string key = rand_key(12);
+    t.insert({key, i});
+    m.insert({key, i});
+  }
+
+  const art<string, int> &ct = t;
+  for (int i = 0; i < 5000; i++) {
+    const string prefix = rand_key(i % 2 ? 6 : 14);
+    vector<pair<string, int>> expect; // in char_type order like the tree
+    for (auto &kv : ct) {
+      if (kv.first.compare(0, prefix.size(), prefix) == 0) {
+        expect.push_back(kv);
+      }
+    }
+
+    vector<pair<string, int>> got;
+    auto r = ct.prefix_range(prefix);
+    for (auto it = r.first; it != r.second; ++it) {
+      got.push_back(*it);
+    }
+    if (got != expect) {
+      throw "bad prefix range";
+    }
+
+    // stops when f returns false
+    size_t seen = 0;
+    const size_t limit = rng() % 4;
+    size_t n = t.scan_prefix(prefix, [&](pair<const string, int> &kv) {
+      if (kv.first.compare(0, prefix.size(), prefix) != 0) {
+        throw "bad prefix scan";
+      }
+      return ++seen < limit;
+    });
+    if (n != min(max(limit, size_t(1)), expect.size())) {
+      throw "bad prefix scan count";
+    }
+  }
+
+  // the empty prefix is the whole tree
+  art<string, int> empty;
+  if (t.scan_prefix("", [](auto &) { return true; }) != t.size() ||
+      empty.prefix_range("").first != empty.end()) {
+    throw "bad prefix scan";
+  }
+
+  // the unescaped last field of a composite key is scanned by prefix
+  art<art_tuple_key<uint32_t, string>, int> names;
+  for (auto &kv : m) {
+    names.insert({{uint32_t(kv.second % 3), kv.first}, kv.second});
+  }
+  size_t expect = 0;
+  for (auto &kv : m) {
+    expect += kv.second % 3 == 1 && kv.first.compare(0, 2, "ab") == 0;
+  }
+  size_t n = names.scan_prefix(make_tuple(1u, string("ab")), [&](auto &kv) {
+    auto fields = kv.first.decode();
+    if (get<0>(fields) != 1 || get<1>(fields).compare(0, 2, "ab") != 0) {
+      throw "bad tuple prefix scan";
+    }
+    return true;
+  });
+  if (n != expect || n == 0) {
+    throw "bad tuple prefix scan";
+  }
+}
+
+void order_statistic_test() {
+  using counted_art =
+      art<string, int, art_slab_allocator<pair<const string, int>>,
+          art_options<true>>;
+  mt19937 rng;
+  auto rand_key = [&]() {
+    string str(rng() % 10, 0);
+    for (auto &c : str) {
+      c = "ab\x80z"[rng() % 4];
+    }
+    return str;
+  };
+  // keys in char_type order like the tree
+  auto less = [](const string &a, const string &b) {
+    return lexicographical_compare(a.begin(), a.end(), b.begin(), b.end());
+  };
+
+  counted_art t;
+  for (int round = 0; round < 4; round++) {
+    for (int i = 0; i < 20000; i++) {
+      if (rng() % 3) {
+        t.insert({rand_key(), i});
+      } else {
+        t.erase(rand_key());
+      }
+    }
+
+    counted_art copy = t;
+    vector<string> keys;
+    for (auto &kv : t) {
+      keys.push_back(kv.first);
+    }
+    counted_art loaded(t.begin(), t.end());
+
+    for (counted_art *c : {&t, &copy, &loaded}) {
+      for (size_t i = 0; i < keys.size(); i += 1 + rng() % 7) {
+        if (c->select(i)->first != keys[i]) {
+          throw "bad select";
+        }
+      }
+      if (c->select(keys.size()) != c->end()) {
+        throw "bad select";
+      }
+
+      for (int i = 0; i < 2000; i++) {
+        const string a = rand_key(), b = rand_key();
+        const size_t ra =
+            lower_bound(keys.begin(), keys.end(), a, less) - keys.begin();
+        const size_t rb =
+            lower_bound(keys.begin(), keys.end(), b, less) - keys.begin();
+        if (c->rank(a) != ra) {
+          throw "bad rank";
+        }
+        if (c->count_range(a, b) != (rb > ra ? rb - ra : 0)) {
+          throw "bad count_range";
+        }
+        const size_t n = count_if(keys.begin(), keys.end(), [&](auto &k) {
+          return k.compare(0, a.size(), a) == 0;
+        });
+        if (c->count_prefix(a) != n) {
+          throw "bad count_prefix";
+        }
+      }
+    }
+  }
+
+  // the count is only in counted nodes
+  if (sizeof(node4<pair<const string, int>, art_options<true>>) !=
+      sizeof(node4<pair<const string, int>>) + sizeof(size_t)) {
+    throw "bad counted node size";
+  }
+}
+
+void unlinked_test() {
+  using unlinked_art =
+      art<string, int, art_slab_allocator<pair<const string, int>>,
+          art_options<true, false>>;
+  mt19937 rng;
+  auto rand_key = [&]() {
+    string str(rng() % 10, 0);
+    for (auto &c : str) {
+      c = "ab\x80z"[rng() % 4];
+    }
+    return str;
+  };
+
+  // the linked tree has the same order
+  art<string, int> m;
+  unlinked_art t;
+  for (int round = 0; round < 4; round++) {
+    for (int i = 0; i < 20000; i++) {
+      const string key = rand_key();
+      if (rng() % 3) {
+        if (t.insert({key, i}).second != m.insert({key, i}).second) {
+          throw "bad unlinked insert";
+        }
+      } else if (rng() % 2) {
+        if (t.erase(key) != m.erase(key)) {
+          throw "bad unlinked erase";
+        }
+      } else {
+        auto it = t.lower_bound(key);
+        auto mit = m.lower_bound(key);
+        if ((it == t.end()) != (mit == m.end()) ||
+            (mit != m.end() && it->first != mit->first)) {
+          throw "bad unlinked lower_bound";
+        }
+        if (mit != m.end()) {
+          const string erased = it->first;
+          auto next = t.erase(it);
+          if (next != t.upper_bound(erased)) {
+            throw "bad unlinked erase iterator";
+          }
+          m.erase(mit);
+        }
+      }
+    }
+
+    unlinked_art copy = t;
+    unlinked_art loaded(t.begin(), t.end());
+    for (unlinked_art *c : {&t, &copy, &loaded}) {
+      if (!same_contents(*c, m) || c->size() != m.size()) {
+        throw "bad unlinked iteration";
+      }
+      // backwards from end()
+      auto it = c->end();
+      for (auto mit = m.end(); mit != m.begin();) {
+        --mit;
+        --it;
+        if (it->first != mit->first) {
+          throw "bad unlinked reverse iteration";
+        }
+      }
+      if (it != c->begin()) {
+        throw "bad unlinked reverse iteration";
+      }
+
+      const string prefix = rand_key().substr(0, 2);
+      auto r = c->prefix_range(prefix);
+      auto mr = m.prefix_range(prefix);
+      auto mit = mr.first;
+      for (auto it = r.first; it != r.second; ++it, ++mit) {
+        if (mit == mr.second || it->first != mit->first) {
+          throw "bad unlinked prefix_range";
+        }
+      }
+      if (mit != mr.second) {
+        throw "bad unlinked prefix_range";
+      }
+
+      // subtree counts are kept without links too
+      size_t i = 0;
+      for (auto &kv : *c) {
+        if (c->select(i++)->first != kv.first) {
+          throw "bad unlinked select";
+        }
+      }
+    }
+  }
+
+  // no links in any node
+  if (sizeof(node4<pair<const string, int>, art_options<false, false>>) !=
+      sizeof(node4<pair<const string, int>>) - sizeof(node_link_base)) {
+    throw "bad unlinked node size";
+  }
+}
+
+template <typename Options> void snapshot_test() {
+  using snapshot_art =
+      art<string, int, art_slab_allocator<pair<const string, int>>, Options>;
+  using contents = vector<pair<string, int>>;
+  mt19937 rng;
+  auto rand_key = [&]() {
+    string str(rng() % 8, 0);
+    for (auto &c : str) {
+      c = "ab\x80z"[rng() % 4];
+    }
+    return str;
+  };
+  auto dump = [](const typename snapshot_art::snapshot_view &s) {
+    contents v;
+    s.scan([&](const pair<const string, int> &kv) {
+      v.emplace_back(kv.first, kv.second);
+      return true;
+    });
+    return v;
+  };
+  auto copy = [](const art<string, int> &m) {
+    contents v;
+    for (auto &kv : m) {
+      v.emplace_back(kv.first, kv.second);
+    }
+    return v;
+  };
+  auto write = [&](snapshot_art &t, art<string, int> &m, int i) {
+    const string key = rand_key();
+    switch (rng() % 5) {
+    case 0:
+      t.insert({key, i});
+      m.insert({key, i});
+      break;
+    case 1:
+      t[key] = i;
+      m[key] = i;
+      break;
+    case 2:
+      t.insert_or_assign(key, -i);
+      m.insert_or_assign(key, -i);
+      break;
+    case 3:
+      if (t.erase(key) != m.erase(key)) {
+        throw "bad snapshot erase";
+      }
+      break;
+    default:
+      auto it = t.lower_bound(key);
+      if (it != t.end()) {
+        m.erase(it->first);
+        t.erase(it);
+      }
+    }
+  };
+
+  snapshot_art t;
+  art<string, int> m;
+  vector<typename snapshot_art::snapshot_view> snapshots;
+  vector<contents> expected;
+  for (int round = 0; round < 8; round++) {
+    for (int i = 0; i < 5000; i++) {
+      write(t, m, i);
+    }
+    if (!same_contents(t, m)) {
+      throw "bad snapshot tree";
+    }
+
+    snapshots.push_back(t.snapshot());
+    expected.push_back(copy(m));
+    if (round % 3 == 2) {
+      // close one in the middle
+      snapshots.erase(snapshots.begin() + round / 3);
+      expected.erase(expected.begin() + round / 3);
+    }
+
+    for (size_t j = 0; j < snapshots.size(); j++) {
+      auto &s = snapshots[j];
+      if (s.size() != expected[j].size() || dump(s) != expected[j]) {
+        throw "bad snapshot contents";
+      }
+      for (int k = 0; k < 100; k++) {
+        const string key = rand_key();
+        auto it = find_if(expected[j].begin(), expected[j].end(),
+                          [&](auto &kv) { return kv.first == key; });
+        const auto *value = s.find(key);
+        if ((value == nullptr) != (it == expected[j].end()) ||
+            (value != nullptr && value->second != it->second)) {
+          throw "bad snapshot find";
+        }
+      }
+      const string prefix = rand_key().substr(0, 2);
+      const size_t n =
+          count_if(expected[j].begin(), expected[j].end(), [&](auto &kv) {
+            return kv.first.compare(0, prefix.size(), prefix) == 0;
+          });
+      if (s.scan_prefix(prefix, [](auto &) { return true; }) != n) {
+        throw "bad snapshot scan_prefix";
+      }
+    }
+  }
+
+  // a reader goes through a snapshot while the tree is written
+  {
+    auto s = t.snapshot();
+    const contents before = copy(m);
+    bool same = true;
+    thread reader([&] {
+      for (int i = 0; i < 20; i++) {
+        same = same && dump(s) == before;
+      }
+      s.release();
+    });
+    for (int i = 0; i < 20000; i++) {
+      write(t, m, i);
+    }
+    reader.join();
+    if (!same) {
+      throw "bad concurrent snapshot";
+    }
+  }
+  if (!same_contents(t, m)) {
+    throw "bad snapshot tree";
+  }
+
+  // nodes seen only by closed snapshots are freed
+  snapshots.clear();
+  t.insert({"x", 0});
+  if (!t.t_.impl_.retired_.empty()) {
+    throw "retired nodes kept";
+  }
+  t.clear();
+  if (t.t_.impl_.node_counter_ != 0) {
+    throw "snapshot nodes leaked";
+  }
+
+  // writes that change nothing copy nothing
+  auto fill = [](snapshot_art &a, int sign) {
+    for (int i = 0; i < 1000; i++) {
+      a.insert({to_string(i), sign * i});
+    }
+  };
+  fill(t, 1);
+  {
+    auto s = t.snapshot();
+    const size_t nodes = t.t_.impl_.node_counter_;
+    if (t.insert({"1", 5}).second || t.erase("none") != 0 ||
+        !t.t_.impl_.retired_.empty() || t.t_.impl_.node_counter_ != nodes) {
+      throw "bad snapshot copy";
+    }
+    t["1"] = 7;
+    t.erase("999");
+    if (s.find("1")->second != 1 || s.find("999") == nullptr ||
+        t["1"] != 7 || t.count("999") != 0) {
+      throw "bad snapshot copy";
+    }
+  }
+
+  // a view outlives its tree and follows it through swap
+  snapshot_art a, b;
+  fill(a, 1);
+  fill(b, -1);
+  auto sa = a.snapshot();
+  const contents before = dump(sa);
+  a.swap(b);
+  for (int i = 0; i < 500; i++) {
+    b.erase(to_string(i));
+  }
+  auto sb = b.snapshot();
+  const contents after = dump(sb);
+  b = snapshot_art();
+  auto late = [&] {
+    snapshot_art gone;
+    fill(gone, 1);
+    auto s = gone.snapshot();
+    gone.clear();
+    return s;
+  }();
+  if (dump(sa) != before || dump(sb) != after || after.size() != 500 ||
+      dump(late) != before) {
+    throw "bad snapshot after tree";
+  }
+}
+
+void snapshot_test() {
+  snapshot_test<art_options<false, true, true>>();
+  snapshot_test<art_options<true, false, true>>();
+}
+
+// the frozen image answers like the tree it was made from
+template <typename Tree, typename Frozen, typename Gen>
+void check_frozen(const Tree &t, const Frozen &f, Gen gen) {
+  if (f.size() != t.size()) {
+    throw "bad frozen size";
+  }
+  auto it = f.begin();
+  for (auto &kv : t) {
+    if (it.key() != kv.first || it.value() != kv.second) {
+      throw "bad frozen iteration";
+    }
+    ++it;
+  }
+  if (it != f.end()) {
+    throw "bad frozen end";
+  }
+
+  for (int i = 0; i < 20000; i++) {
+    const auto key = gen();
+    auto check = [&](auto t_it, auto f_it) {
+      if ((t_it == t.end()) != (f_it == f.end()) ||
+          (t_it != t.end() &&
+           (t_it->first != f_it.key() || t_it->second != f_it.value()))) {
+        throw "bad frozen lookup";
+      }
+    };
+    check(t.find(key), f.find(key));
+    check(t.lower_bound(key), f.lower_bound(key));
+    check(t.upper_bound(key), f.upper_bound(key));
+  }
+}
+
+void freeze_test() {
+  mt19937 rng;
+  auto rand_key = [&]() {
+    string str(rng() % 6, 0);
+    for (auto &c : str) {
+      // some bytes spread over node48 and node256 children
+      c = rng() % 4 ? "ab\x80z"[rng() % 4] : static_cast<char>(rng());
+    }
+    return str;
+  };
+
+  art<string, int> t;
+  for (int i = 0; i < 50000; i++) {
+    t.insert({rand_key(), i});
+  }
+  const vector<char> image = t.freeze();
+  check_frozen(t, frozen_art<string, int>(image.data(), image.size()),
+               rand_key);
+
+  art<int64_t, double> ints;
+  auto rand_int = [&]() { return int64_t(rng() % 100000) - 50000; };
+  for (int i = 0; i < 20000; i++) {
+    ints.insert({rand_int(), i / 2.0});
+  }
+  const char *path = "art_freeze_test.img";
+  ints.freeze(path);
+  {
+    frozen_art<int64_t, double> f(path);
+    check_frozen(ints, f, rand_int);
+  }
+  remove(path);
+
+  const vector<char> empty_image = art<string, int>().freeze();
+  frozen_art<string, int> empty(empty_image.data(), empty_image.size());
+  if (!empty.empty() || empty.lower_bound("a") != empty.end()) {
+    throw "bad empty image";
+  }
+
+  bool rejected = false;
+  try {
+    frozen_art<string, double> wrong(image.data(), image.size());
+  } catch (const char *) {
+    rejected = true;
+  }
+  if (!rejected) {
+    throw "bad image accepted";
+  }
+}
+
+// a value with no default constructor
+struct point {
+  explicit point(int x, int y) : x(x), y(y) {}
+  bool operator==(const point &o) const { return x == o.x && y == o.y; }
+  int x, y;
+};
+
+void save_load_test() {
+  mt19937 rng;
+  auto rand_key = [&]() {
+    string str(rng() % 20, 0);
+    for (auto &c : str) {
+      c = rng() % 4 ? "ab\x80z"[rng() % 4] : static_cast<char>(rng());
+    }
+    return str;
+  };
+
+  // enough for many blocks, loaded over a tree that is not empty
+  art<string, string> t;
+  for (int i = 0; i < 50000; i++) {
+    t.insert({rand_key(), string(rng() % 40, 'a' + i % 26)});
+  }
+  stringstream dump;
+  t.save(dump);
+  art<string, string> loaded;
+  loaded.insert({"stale", "x"});
+  loaded.load(dump);
+  if (!same_contents(loaded, t)) {
+    throw "bad load";
+  }
+
+  using ints_type =
+      art<int64_t, double, art_slab_allocator<pair<const int64_t, double>>,
+          art_options<true, false>>;
+  art<int64_t, double> ints;
+  for (int i = 0; i < 20000; i++) {
+    ints.insert({int64_t(rng()) - (1ll << 31), i / 2.0});
+  }
+  stringstream int_dump;
+  ints.save(int_dump);
+  ints_type loaded_ints;
+  loaded_ints.load(int_dump);
+  auto it = ints.begin();
+  for (int i = 0; i < 1000; i++) {
+    ++it;
+  }
+  if (!same_contents(loaded_ints, ints) ||
+      loaded_ints.rank(it->first) != 1000) {
+    throw "bad load";
+  }
+
+  using tuple_type = art_tuple_key<int32_t, string>;
+  art<tuple_type, int> tuples, loaded_tuples;
+  for (int i = 0; i < 1000; i++) {
+    tuples.insert({tuple_type(int32_t(rng() % 100) - 50, rand_key()), i});
+  }
+  stringstream tuple_dump;
+  tuples.save(tuple_dump);
+  loaded_tuples.load(tuple_dump);
+  if (!same_contents(loaded_tuples, tuples)) {
+    throw "bad load";
+  }
+
+  art<string, point> points, loaded_points;
+  for (int i = 0; i < 1000; i++) {
+    points.insert({rand_key(), point(i, -i)});
+  }
+  stringstream point_dump;
+  points.save(point_dump);
+  loaded_points.load(point_dump);
+  if (!same_contents(loaded_points, points)) {
+    throw "bad load";
+  }
+
+  stringstream empty_dump;
+  art<string, string>().save(empty_dump);
+  loaded.load(empty_dump);
+  if (!loaded.empty()) {
+    throw "bad empty load";
+  }
+
+  // a flipped byte, a cut stream and another value type are rejected and
+  // leave the tree empty
+  const string bytes = dump.str();
+  string flipped = bytes;
+  flipped[flipped.size() / 2] ^= 0x10;
+  auto rejected = [](auto &tree, const string &bytes) {
+    stringstream in(bytes);
+    try {
+      tree.load(in);
+    } catch (const char *) {
+      return tree.empty();
+    }
+    return false;
+  };
+  art<string, int> wrong;
+  if (!rejected(loaded, flipped) ||
+      !rejected(loaded, bytes.substr(0, bytes.size() - 5)) ||
+      !rejected(wrong, bytes)) {
+    throw "bad dump accepted";
+  }
+}
+
+// the walk agrees with the counters kept as nodes are made and freed, and
+// every node but the root is the child of one node
+template <typename Options> void stats_test() {
+  using tree_type =
+      art<string, string, art_slab_allocator<pair<const string, string>>,
+          Options>;
+  using node4_type = node4<typename tree_type::value_type, Options>;
+  auto check = [](const tree_type &t) {
+    const art_stats s = t.stats();
+    size_t children = 0, fanout_nodes = 0, subfix_nodes = 0;
+    for (size_t i = 0; i < s.fanout.size(); i++) {
+      children += i * s.fanout[i];
+      fanout_nodes += s.fanout[i];
+    }
+    for (size_t n : s.subfix_sizes) {
+      subfix_nodes += n;
+    }
+    const size_t nodes = s.total_nodes();
+    if (s.data_nodes != t.size() || fanout_nodes != nodes ||
+        subfix_nodes != nodes || (nodes != 0 && children != nodes - 1) ||
+        nodes - s.fanout[0] != s.inner_nodes ||
+        s.node_bytes[1] != s.nodes[1] * sizeof(node4_type)) {
+      throw "bad stats";
+    }
+    if (!Options::snapshots &&
+        (s.nodes != t.node_counts() || nodes != t.t_.impl_.node_counter_)) {
+      throw "bad node counts";
+    }
+    return s;
+  };
+
+  tree_type t;
+  t.insert({"abc", ""});
+  t.insert({"abd", ""});
+  t.insert({"ab", ""});
+  art_stats s = check(t);
+  if (s.nodes[0] != 2 || s.nodes[1] != 1 || s.inner_nodes != 1 ||
+      s.data_nodes != 3 || s.depth_sum != 2 || s.max_depth != 1 ||
+      s.fanout[2] != 1 || s.subfix_sizes[2] != 1 || s.subfix_sizes[0] != 2 ||
+      s.key_heap_bytes != 0 ||
+      s.value_box_bytes != sizeof(typename tree_type::value_type)) {
+    throw "bad stats";
+  }
+  // only the inner nodes that hold an element pay for its value
+  if (sizeof(node4_type) - sizeof(node_base<typename tree_type::value_type,
+                                            Options>) >=
+      sizeof(typename tree_type::value_type)) {
+    throw "bad node size";
+  }
+
+  // long shared chunks are left in the keys below, long keys and values
+  // are on the heap
+  mt19937 rng;
+  vector<string> keys;
+  const string chunk(100, 'p');
+  for (int i = 0; i < 20000; i++) {
+    string str = string(rng() % 3, 'a' + rng() % 3) + chunk +
+                 generate_rand_string() + string(rng() % 20, 'z');
+    keys.push_back(str);
+    t.insert({str, string(rng() % 40, 'v')});
+  }
+  s = check(t);
+  if (s.key_heap_bytes == 0 || s.value_heap_bytes == 0 ||
+      s.max_depth < 2 ||
+      s.average_depth() > s.max_depth) {
+    throw "bad heap stats";
+  }
+
+  {
+    // the snapshot keeps shared and retired nodes while keys are erased
+    [[maybe_unused]] auto view = [&]() {
+      if constexpr (Options::snapshots) {
+        return t.snapshot();
+      } else {
+        return 0;
+      }
+    }();
+    for (size_t i = 0; i < keys.size(); i += 2) {
+      t.erase(keys[i]);
+    }
+    check(t);
+  }
+  t.insert({"ab", ""});
+  check(t);
+
+  t.clear();
+  s = check(t);
+  if (s.total_nodes() != 0 || s.max_depth != 0) {
+    throw "bad clear stats";
+  }
+}
+
+void stats_test() {
+  stats_test<art_options<>>();
+  stats_test<art_options<true, false>>();
+  stats_test<art_options<false, true, true>>();
+}
+
+struct counted {
+  static int constructs;
+  counted(int v = 0) : v(v) { ++constructs; }
+  counted(const counted &other) : v(other.v) { ++constructs; }
+  counted(counted &&other) : v(other.v) {}
+  counted &operator=(const counted &) = default;
+  counted &operator=(counted &&) = default;
+  int v;
+};
+int counted::constructs = 0;
+
+void emplace_test() {
+  art<string, counted> t;
+  string k1 = "key1", k2 = "key2";
+
+  if (!t.try_emplace(k1, 1).second || counted::constructs != 1) {
+    throw "bad try_emplace";
+  }
+  if (t.try_emplace(k1, 2).second || counted::constructs != 1 ||
+      t[k1].v != 1) {
+    throw "bad try_emplace";
+  }
+
+  if (!t.insert_or_assign(k2, counted(3)).second ||
+      t.insert_or_assign(k2, counted(4)).second || t.at(k2).v != 4) {
+    throw "bad insert_or_assign";
+  }
+
+  // rvalue insert moves the value
+  counted::constructs = 0;
+  t.insert(make_pair(string("key3"), counted()));
+  t.emplace(string("key4"), counted());
+  t.insert({"key5", counted()});
+  if (counted::constructs != 3 || t.size() != 5) {
+    throw "bad insert";
+  }
+
+  t.emplace(piecewise_construct, forward_as_tuple("key6"), forward_as_tuple(6));
+  if (t.find("key6")->second.v != 6) {
+    throw "bad emplace";
+  }
+
+  string k7 = "key7";
+  t[std::move(k7)].v = 7;
+  if (t["key7"].v != 7 || t.size() != 7) {
+    throw "bad operator[]";
+  }
+}
+
+void heterogeneous_lookup_test() {
+  art<string, int> t;
+  for (int i = 0; i < 1000; ++i) {
+    t[to_string(i * 2)] = i;
+  }
+
+  // probe slices of a buffer that holds several keys back to back
+  const char buf[] = "100|101|1998|";
+  string_view k1(buf, 3), k2(buf + 4, 3), k3(buf + 8, 4);
+  if (t.find(k1) == t.end() || t.find(k1)->second != 50 ||
+      t.find(k2) != t.end() || t.count(buf + 8, 4) != 1 ||
+      t.at(k3) != 999) {
+    throw "bad find";
+  }
+  if (t.lower_bound(k2)->first != "1010" ||
+      t.upper_bound(buf, 3)->first != "1000" ||
+      t.equal_range(k1).first->first != "100") {
+    throw "bad bound";
+  }
+  const auto &ct = t;
+  if (ct.find(buf + 8, 4) == ct.end() || ct.lower_bound(k3) != ct.find(k3)) {
+    throw "bad const find";
+  }
+  if (t.erase(k1) != 1 || t.erase(buf, 3) != 0 || t.count("100") != 0 ||
+      t.size() != 999) {
+    throw "bad erase";
+  }
+}
+
+// readers run next to a writer that keeps splitting and merging the paths of
+// keys that are never erased
+void concurrent_art_test() {
+  mt19937 rng;
+  map<string, int> m;
+  concurrent_art<string, int> t;
+  vector<string> v;
+
+  for (int i = 0; i < 50000; i++) {
+    string str = string(rng() % 40, 'a' + rng() % 3) + generate_rand_string();
+    v.push_back(str);
+    if (m.insert({str, i}).second != t.insert({str, i})) {
+      throw "bad insert";
+    }
+  }
+  for (size_t i = 0; i < v.size(); i += 2) {
+    if (m.erase(v[i]) != t.erase(v[i])) {
+      throw "bad erase";
+    }
+  }
+  auto it = m.begin();
+  t.scan("", [&](const pair<const string, int> &kv) {
+    if (it == m.end() || kv.first != it->first || kv.second != it->second) {
+      throw "bad scan";
+    }
+    ++it;
+    return true;
+  });
+  if (it != m.end() || t.size() != m.size()) {
+    throw "bad scan";
+  }
+  t.reclaim();
+
+  vector<string> stable(m.size());
+  transform(m.begin(), m.end(), stable.begin(),
+            [](const pair<const string, int> &kv) { return kv.first; });
+  atomic<bool> done(false), failed(false);
+
+  thread writer([&] {
+    mt19937 rng;
+    for (int round = 0; round < 20; round++) {
+      vector<string> churn;
+      for (int i = 0; i < 5000; i++) {
+        string str = stable[rng() % stable.size()];
+        if (rng() % 2 == 0) {
+          str.resize(rng() % str.size());
+        } else {
+          str += string(rng() % 3 + 1, 'a' + rng() % 26);
+        }
+        if (t.insert({str, -1})) {
+          churn.push_back(str);
+        }
+      }
+      for (const string &str : churn) {
+        t.erase(str);
+      }
+    }
+    done = true;
+  });
+
+  vector<thread> readers;
+  for (int r = 0; r < 3; r++) {
+    readers.emplace_back([&, r] {
+      mt19937 rng(r);
+      while (!done) {
+        const string &key = stable[rng() % stable.size()];
+        int value;
+        if (!t.find(key, value) || value != m.at(key) || t.count(key) != 1) {
+          failed = true;
+        }
+
+        string prev;
+        size_t n = 0;
+        t.scan(key, [&](const pair<const string, int> &kv) {
+          if (n > 0 && kv.first <= prev) {
+            failed = true;
+          }
+          prev = kv.first;
+          n += kv.second >= 0;
+          return n < 50;
+        });
+        string found;
+        if (!t.lower_bound(key, found, value) || found != key) {
+          failed = true;
+        }
+      }
+    });
+  }
+  writer.join();
+  for (thread &reader : readers) {
+    reader.join();
+  }
+
+  if (failed || t.size() != stable.size()) {
+    throw "bad concurrent read";
+  }
+
+  // the writer has exited, its limbo list is taken over
+  t.reclaim();
+  for (auto *r = t.epochs_.state_->records.load(); r != nullptr; r = r->next) {
+    if (!r->limbo.empty()) {
+      throw "bad reclaim";
+    }
+  }
+
+  // writers on shared prefixes only lock the nodes they change, so each key
+  // has one owner and the result is known
+  vector<string> keys;
+  {
+    map<string, int> pool;
+    while (pool.size() < 40000) {
+      pool[string(rng() % 20, 'a' + rng() % 3) + generate_rand_string()];
+    }
+    for (const auto &kv : pool) {
+      keys.push_back(kv.first);
+    }
+  }
+  shuffle(keys.begin(), keys.end(), rng);
+  concurrent_art<string, int> w;
+  // node slots cached by the threads go back to an allocator without an arena
+  concurrent_art<uint64_t, int, allocator<pair<const uint64_t, int>>> u;
+  const int writers = 4;
+  done = false;
+  vector<thread> threads;
+  for (int id = 0; id < writers; id++) {
+    threads.emplace_back([&, id] {
+      // insert all, erase the unkept keys, then erase every key again and
+      // put the kept ones back
+      for (int round = 0; round < 3; round++) {
+        for (size_t i = id; i < keys.size(); i += writers) {
+          const uint64_t k = i * 0x9e3779b97f4a7c15;
+          const bool kept = i / writers % 3 == 0;
+          if (round == 0) {
+            failed = failed || !w.insert({keys[i], int(i)}) ||
+                     !u.insert({k, int(i)});
+          } else if (round == 1 && !kept) {
+            failed = failed || w.erase(keys[i]) != 1 || u.erase(k) != 1;
+          } else if (round == 2) {
+            failed = failed || w.erase(keys[i]) != kept ||
+                     u.erase(k) != kept || !w.insert({keys[i], -1}) ||
+                     !u.insert({k, -1}) ||
+                     (!kept && w.erase(keys[i]) + u.erase(k) != 2);
+          }
+        }
+      }
+    });
+  }
+  thread reader([&] {
+    while (!done) {
+      string prev;
+      w.scan("", [&](const pair<const string, int> &kv) {
+        failed = failed || (!prev.empty() && kv.first <= prev);
+        prev = kv.first;
+        return true;
+      });
+      uint64_t last = 0;
+      u.scan(0, [&](const pair<const uint64_t, int> &kv) {
+        failed = failed || (last != 0 && kv.first <= last);
+        last = kv.first;
+        return true;
+      });
+    }
+  });
+  for (thread &writer : threads) {
+    writer.join();
+  }
+  done = true;
+  reader.join();
+
+  map<string, int> expected;
+  map<uint64_t, int> expected_u;
+  for (size_t i = 0; i < keys.size(); i++) {
+    if (i / writers % 3 == 0) {
+      expected[keys[i]] = -1;
+      expected_u[i * 0x9e3779b97f4a7c15] = -1;
+    }
+  }
+  auto e = expected.begin();
+  w.scan("", [&](const pair<const string, int> &kv) {
+    failed = failed || e == expected.end() || kv != *e++;
+    return true;
+  });
+  auto eu = expected_u.begin();
+  u.scan(0, [&](const pair<const uint64_t, int> &kv) {
+    failed = failed || eu == expected_u.end() || kv != *eu++;
+    return true;
+  });
+  if (failed || e != expected.end() || eu != expected_u.end() ||
+      w.size() != expected.size() || u.size() != expected_u.size()) {
+    throw "bad concurrent write";
+  }
+}
+
+// an object is freed only after every thread that was in a critical section
+// when it was retired has left
+void epoch_manager_test() {
+  int freed = 0;
+  epoch_manager em;
+  epoch_manager::thread_record *reader = em.register_thread();
+  auto deleter = [](void *context, void *ptr) {
+    ++*static_cast<int *>(context);
+    delete static_cast<int *>(ptr);
+  };
+
+  em.enter(reader);
+  em.retire(new int(1), deleter, &freed);
+  em.reclaim();
+  if (freed != 0) {
+    throw "bad epoch";
+  }
+
+  // nested sections leave with the outer one
+  em.enter(reader);
+  em.leave(reader);
+  em.reclaim();
+  if (freed != 0) {
+    throw "bad epoch";
+  }
+
+  em.leave(reader);
+  em.reclaim();
+  if (freed != 1) {
+    throw "bad epoch";
+  }
+
+  for (int i = 0; i < 1000; i++) {
+    epoch_manager::guard guard(em);
+    em.retire(new int(i), deleter, &freed);
+  }
+  // retiring inside a critical section still frees older objects
+  if (em.this_thread()->limbo.size() > 2 * epoch_manager::collect_threshold) {
+    throw "bad epoch";
+  }
+  em.unregister_thread(reader);
+  if (em.register_thread() != reader) {
+    throw "bad register";
+  }
+
+  const int before = freed;
+  {
+    epoch_manager other;
+    other.retire(new int(0), deleter, &freed);
+  }
+  if (freed != before + 1) {
+    throw "bad release";
+  }
+}
+
+void multi_find_test() {
+  mt19937 rng;
+  art<string, int> t;
+  vector<string> keys;
+  for (int i = 0; i < 20000; i++) {
+    string str = string(rng() % 50, 'a' + rng() % 3) + generate_rand_string();
+    keys.push_back(str);
+    t.insert({str, i});
+  }
+  // probes that miss at every depth
+  for (int i = 0; i < 20000; i++) {
+    string str = keys[rng() % keys.size()];
+    str.resize(rng() % (str.size() + 1));
+    keys.push_back(str + (rng() % 2 ? "~" : ""));
+  }
+  random_shuffle(keys.begin(), keys.end(), [&](size_t n) { return rng() % n; });
+
+  for (size_t n : {0, 1, 15, 17, 4096, 40000}) {
+    vector<art<string, int>::iterator> results(n);
+    t.multi_find(keys.data(), n, results.data());
+    for (size_t i = 0; i < n; i++) {
+      if (results[i] != t.find(keys[i])) {
+        throw "bad multi_find";
+      }
+    }
+  }
+
+  const art<string, int> &ct = t;
+  vector<string_view> views(keys.begin(), keys.begin() + 100);
+  vector<art<string, int>::const_iterator> results(views.size());
+  ct.multi_find(views.data(), views.size(), results.data());
+  for (size_t i = 0; i < views.size(); i++) {
+    if (results[i] != ct.find(views[i])) {
+      throw "bad multi_find";
+    }
+  }
+
+  art<string, int> empty;
+  art<string, int>::iterator it;
+  empty.multi_find(keys.data(), 1, &it);
+  if (it != empty.end()) {
+    throw "bad multi_find";
+  }
+}
+
 size_t n_ = 0;
 
 template <typename T> struct my_allocator {
@@ -396,6 +1896,78 @@ void ctor_test() {
   }
 }
 
+void slab_allocator_test() {
+  using V = art<string, int>::value_type;
+  using node_alloc = art_tree<string, V, art_slab_allocator<V>>::
+      node_alloca_traits_rebind<node0<V>>;
+
+  art<string, int> t1, t2;
+  for (int i = 0; i < 10000; i++) {
+    t1.insert({generate_rand_string(), i});
+    t2.insert({generate_rand_string(), i});
+  }
+
+  // nodes must follow their pools
+  t1.swap(t2);
+  for (int i = 0; i < 5000; i++) {
+    t1.erase(t1.begin());
+    t2.erase(t2.begin());
+  }
+  art<string, int> t3(std::move(t1));
+  t3.insert({"slab", 0});
+
+  t2.clear();
+  if (static_cast<node_alloc &>(t2.t_.impl_).pool_->chunks_ != nullptr) {
+    throw "bad release";
+  }
+
+  // rebinds share the pools, and one frees what the other allocated
+  art_slab_allocator<int> a;
+  art_slab_allocator<double> b(a);
+  art_slab_allocator<int> c(b);
+  if (a != c || b != a || a == art_slab_allocator<int>()) {
+    throw "bad rebind";
+  }
+  int *p = a.allocate(1);
+  c.deallocate(p, 1);
+  if (a.allocate(1) != p) {
+    throw "bad rebind";
+  }
+
+  // no pool before the first node
+  art<string, int> lazy;
+  if (!lazy.get_allocator().arena_->pools_.empty()) {
+    throw "bad lazy pool";
+  }
+
+  // a tree that shares its pools does not drop them on clear
+  art<string, int> t4(t3.get_allocator());
+  const art<string, int> copy(t3);
+  for (int i = 0; i < 10000; i++) {
+    t4.insert({generate_rand_string(), i});
+  }
+  t4.clear();
+  for (int i = 0; i < 10000; i++) {
+    t4.insert({generate_rand_string(), -i});
+  }
+  if (!same_contents(t3, copy)) {
+    throw "bad shared release";
+  }
+
+  struct alignas(64) wide {
+    char c[8];
+  };
+  art_slab_allocator<wide> w;
+  wide *one = w.allocate(1);
+  wide *many = w.allocate(3);
+  if (reinterpret_cast<uintptr_t>(one) % 64 != 0 ||
+      reinterpret_cast<uintptr_t>(many) % 64 != 0) {
+    throw "bad alignment";
+  }
+  w.deallocate(one, 1);
+  w.deallocate(many, 3);
+}
+
 void allocator_test() {
   using my_string = basic_string<char, char_traits<char>, my_allocator<char>>;
 
@@ -503,7 +2075,26 @@ void performance_test() {
 
 int main() {
   stress_test();
+  byte_key_test();
+  long_prefix_test();
+  shrink_test();
+  bulk_load_test();
+  emplace_test();
+  heterogeneous_lookup_test();
+  multi_find_test();
+  integer_key_test();
+  tuple_key_test();
+  prefix_scan_test();
+  order_statistic_test();
+  unlinked_test();
+  snapshot_test();
+  freeze_test();
+  save_load_test();
+  stats_test();
+  concurrent_art_test();
+  epoch_manager_test();
   ctor_test();
+  slab_allocator_test();
   allocator_test();
   performance_test();
 